@@ -16,6 +16,7 @@
 
 /*---------------------------------------------------------------------------*/
 #define MSG_PERIOD (30 * CLOCK_SECOND)  // send every 30 seconds
+#define MSG_PERIOD_MAX (2 * MSG_PERIOD) // at most, backed off on congestion
 #define COLLECT_CHANNEL 0xAA
 /*---------------------------------------------------------------------------*/
 #if CONTIKI_TARGET_ZOUL
@@ -49,6 +50,8 @@ PROCESS_THREAD(app_process, ev, data)
   static struct etimer rnd;
   static struct etimer periodic;
   static test_msg_t msg = {.seqn = 0};
+  static clock_time_t period = MSG_PERIOD;
+  int ret;
 
   PROCESS_BEGIN();
 
@@ -71,10 +74,10 @@ PROCESS_THREAD(app_process, ev, data)
   etimer_set(&periodic, MSG_PERIOD);
   while(1) {
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&periodic));
-    /* Fixed interval */
-    etimer_reset(&periodic);
+    /* Fixed interval, longer while the network is congested */
+    etimer_set(&periodic, period);
     /* Random shift within the second half of the interval */
-    etimer_set(&rnd, (MSG_PERIOD / 2) + random_rand() % (MSG_PERIOD / 2));
+    etimer_set(&rnd, (period / 2) + random_rand() % (period / 2));
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&rnd));
 
 #if CONTIKI_TARGET_ZOUL
@@ -109,9 +112,18 @@ PROCESS_THREAD(app_process, ev, data)
     printf("App: Send seqn %d to %02x:%02x\n",
       msg.seqn, dest.u8[0], dest.u8[1]); 
     
-    rp_send(&conn, &dest);
+    ret = rp_send(&conn, &dest);
     msg.seqn++;
 
+    /* Back off: a quarter longer when congested or dropped, then back to
+       MSG_PERIOD a quarter of it at a time. Gently: the relays take their
+       share by choosing other parents. */
+    if (ret == RP_SEND_CONGESTED || ret == 0) {
+      period = period + period / 4 < MSG_PERIOD_MAX ? period + period / 4 : MSG_PERIOD_MAX;
+    } else if (period > MSG_PERIOD) {
+      period = period - MSG_PERIOD / 4 > MSG_PERIOD ? period - MSG_PERIOD / 4 : MSG_PERIOD;
+    }
+
   }
   PROCESS_END();
 }
@@ -0,0 +1,316 @@
+/*
+ * Routing table benchmark, host build.
+ *
+ * Times the routing table operations of rp.c on a table of `entries` routes
+ * (the pool is sized at build time with RP_CONF_MAX_ROUTES, see
+ * host/Makefile.host) and prints one row per operation:
+ *   op  entries  ns/op  allocs/op
+ * where allocs are the route pool slots taken (route_pool_get_stats()).
+ *
+ *   make host-bench
+ *   host/build/rp-bench-1000 1000
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "rp.h"
+
+/*---------------------------------------------------------------------------*/
+static struct rp_conn conn;
+static const struct rp_callbacks callbacks = { .recv = NULL };
+static FILE *out;
+
+/* Addresses 02:00, 03:00, ... (01:00 is the benchmarked node itself) */
+static linkaddr_t
+addr_of(unsigned i)
+{
+  linkaddr_t a;
+  a.u8[0] = (i + 2) & 0xFF;
+  a.u8[1] = (i + 2) >> 8;
+  return a;
+}
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(const char *op, unsigned entries, double ns, unsigned long ops,
+       unsigned long allocs)
+{
+  fprintf(out, "%-28s %8u %12.1f %10.2f\n", op, entries, ns / ops,
+          (double)allocs / ops);
+}
+
+/* Route pool slots taken since rp_open() */
+static unsigned long
+pool_allocs(void)
+{
+  struct route_pool_stats stats;
+  route_pool_get_stats(&stats);
+  return stats.allocs;
+}
+
+/* Fresh node (or sink) with an empty table */
+static void
+reset_node(bool is_sink)
+{
+  host_reset();
+  host_now = 0;
+  memset(&conn, 0, sizeof(conn));
+  rp_open(&conn, 0xAA, is_sink, &callbacks);
+}
+
+/* Fill the table up to `entries` routes (the self route included): neighbors
+   and topology routes grouped behind next hops of 10 destinations each */
+static void
+fill_table(unsigned entries)
+{
+  unsigned i;
+  for(i = 0; i + 1 < entries; i++) {
+    linkaddr_t dest = addr_of(i);
+    linkaddr_t nh = addr_of(i - i % 10);
+    add_route(&conn, &dest, &nh, i % 10 ? ROUTE_TOPOLOGY : ROUTE_NEIGHBOR, 2, -80);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+bench_add_route(unsigned entries)
+{
+  unsigned rounds = 200000 / entries + 1, r, i;
+  unsigned long allocs = 0, a0;
+  double t = 0;
+
+  for(r = 0; r < rounds; r++) {
+    reset_node(false);
+    a0 = pool_allocs();
+    double t0 = now_ns();
+    for(i = 0; i + 1 < entries; i++) {
+      linkaddr_t dest = addr_of(i);
+      add_route(&conn, &dest, &dest, ROUTE_NEIGHBOR, 2, -80);
+    }
+    t += now_ns() - t0;
+    allocs += pool_allocs() - a0;
+  }
+  report("add_route (new)", entries, t, (unsigned long)rounds * (entries - 1), allocs);
+
+  /* Refresh of existing routes, the common case on beacons */
+  a0 = pool_allocs();
+  t = now_ns();
+  for(r = 0; r < rounds; r++) {
+    for(i = 0; i + 1 < entries; i++) {
+      linkaddr_t dest = addr_of(i);
+      add_route(&conn, &dest, &dest, ROUTE_NEIGHBOR, 2, -80);
+    }
+  }
+  t = now_ns() - t;
+  report("add_route (refresh)", entries, t, (unsigned long)rounds * (entries - 1),
+         pool_allocs() - a0);
+}
+
+static void
+bench_lookup_route(unsigned entries)
+{
+  unsigned long ops = 2000000, n;
+  volatile routing_entry_t *found;
+  linkaddr_t parent = addr_of(0);
+  unsigned long a0;
+  double t;
+
+  reset_node(false);
+  fill_table(entries);
+  add_route(&conn, &parent, &parent, ROUTE_PARENT, 1, -70);
+
+  a0 = pool_allocs();
+  t = now_ns();
+  for(n = 0; n < ops; n++) {
+    linkaddr_t dest = addr_of((n * 7919) % (entries - 1));
+    found = lookup_route(&dest, false);
+  }
+  t = now_ns() - t;
+  report("lookup_route (hit)", entries, t, ops, pool_allocs() - a0);
+
+  a0 = pool_allocs();
+  t = now_ns();
+  for(n = 0; n < ops; n++) {
+    linkaddr_t dest = addr_of(entries + n % 1000);
+    found = lookup_route(&dest, false);
+  }
+  t = now_ns() - t;
+  report("lookup_route (parent)", entries, t, ops, pool_allocs() - a0);
+  (void)found;
+}
+
+static void
+bench_purge_old_routes(unsigned entries)
+{
+  unsigned long ops = 20000000 / entries + 1, n, allocs = 0, a0;
+  double t;
+
+  reset_node(false);
+  fill_table(entries);
+
+  /* Nothing to purge: the cost of the periodic scan */
+  a0 = pool_allocs();
+  t = now_ns();
+  for(n = 0; n < ops; n++) {
+    purge_old_routes(&conn);
+  }
+  t = now_ns() - t;
+  report("purge_old_routes (fresh)", entries, t, ops, pool_allocs() - a0);
+
+  /* Everything expired */
+  ops = ops / 10 + 1;
+  t = 0;
+  for(n = 0; n < ops; n++) {
+    reset_node(false);
+    fill_table(entries);
+    host_now += HOST_TICKS_TO_US(cleanup_interval + CLOCK_SECOND);
+    a0 = pool_allocs();
+    double t0 = now_ns();
+    purge_old_routes(&conn);
+    t += now_ns() - t0;
+    allocs += pool_allocs() - a0;
+  }
+  report("purge_old_routes (expired)", entries, t, ops, allocs);
+}
+
+static void
+bench_delete_route_by_next_hop(unsigned entries)
+{
+  unsigned rounds = 200000 / entries + 1, r, g, groups = (entries + 8) / 10;
+  unsigned long allocs = 0, a0;
+  double t = 0;
+
+  /* Remove every next hop group in turn, refill (untimed) between rounds */
+  for(r = 0; r < rounds; r++) {
+    reset_node(false);
+    fill_table(entries);
+    a0 = pool_allocs();
+    double t0 = now_ns();
+    for(g = 0; g < groups; g++) {
+      linkaddr_t nh = addr_of(g * 10);
+      delete_route_by_next_hop(&conn, &nh, false);
+    }
+    t += now_ns() - t0;
+    allocs += pool_allocs() - a0;
+  }
+  report("delete_route_by_next_hop", entries, t, (unsigned long)rounds * groups, allocs);
+}
+
+static void
+bench_update_routing_table(unsigned entries)
+{
+  unsigned long ops = 2000000 / entries + 1000, n, a0;
+  struct topology_report rep;
+  unsigned i;
+  double t;
+
+  reset_node(false);
+  fill_table(entries);
+
+  /* Full one-frame report of a child with a subtree not yet in the table */
+  memset(&rep, 0, sizeof(rep));
+  rep.node = addr_of(entries + 1);
+  rep.metric = 2;
+  rep.frags = 1;
+  for(i = 0; i < REPORT_FRAME_ENTRIES; i++) {
+    rep.subtree[i] = addr_of(entries + 2 + i);
+  }
+
+  a0 = pool_allocs();
+  t = now_ns();
+  for(n = 0; n < ops; n++) {
+    update_routing_table(&conn, &rep, REPORT_FRAME_ENTRIES);
+  }
+  t = now_ns() - t;
+  report("update_routing_table", entries, t, ops, pool_allocs() - a0);
+
+  /* The same at the sink, where the entries overwrite their next hop */
+  reset_node(true);
+  fill_table(entries);
+  a0 = pool_allocs();
+  t = now_ns();
+  for(n = 0; n < ops; n++) {
+    update_routing_table(&conn, &rep, REPORT_FRAME_ENTRIES);
+  }
+  t = now_ns() - t;
+  report("update_routing_table (sink)", entries, t, ops, pool_allocs() - a0);
+}
+
+static void
+bench_is_in_subtree(unsigned entries)
+{
+  unsigned long ops = 2000000, n, found = 0, a0;
+  unsigned i;
+  double t;
+
+  /* A subtree of entries - 1 nodes, the candidate parents are not in it */
+  reset_node(false);
+  for(i = 0; i + 1 < entries; i++) {
+    linkaddr_t a = addr_of(i);
+    add_to_subtree(&conn, &a);
+  }
+
+  a0 = pool_allocs();
+  t = now_ns();
+  for(n = 0; n < ops; n++) {
+    linkaddr_t a = addr_of(entries + n % 1000);
+    found += is_in_subtree(&conn, &a);
+  }
+  t = now_ns() - t;
+  report("is_in_subtree (miss)", entries, t, ops, pool_allocs() - a0);
+
+  ops = 20000000 / entries + 1;
+  a0 = pool_allocs();
+  t = now_ns();
+  for(n = 0; n < ops; n++) {
+    linkaddr_t a = addr_of((n * 7919) % (entries - 1));
+    found += is_in_subtree(&conn, &a);
+  }
+  t = now_ns() - t;
+  report("is_in_subtree (hit)", entries, t, ops, pool_allocs() - a0);
+  if(found == 0) fprintf(out, "is_in_subtree: nothing found\n");
+}
+
+/*---------------------------------------------------------------------------*/
+int
+main(int argc, char **argv)
+{
+  unsigned entries = argc > 1 ? (unsigned)atoi(argv[1]) : 100;
+
+  if(entries < 2 || entries + REPORT_FRAME_ENTRIES + 1 > MAX_ROUTES) {
+    fprintf(stderr, "usage: %s entries (2..%u for this build)\n", argv[0],
+            MAX_ROUTES - REPORT_FRAME_ENTRIES - 1);
+    return 1;
+  }
+
+  /* rp.c logs to stdout, keep the results on a private copy of it */
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if(out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    perror("bench");
+    return 1;
+  }
+
+  linkaddr_node_addr.u8[0] = 1;
+  linkaddr_node_addr.u8[1] = 0;
+
+  bench_add_route(entries);
+  bench_lookup_route(entries);
+  bench_purge_old_routes(entries);
+  bench_delete_route_by_next_hop(entries);
+  bench_update_routing_table(entries);
+  bench_is_in_subtree(entries);
+
+  fclose(out);
+  return 0;
+}
@@ -0,0 +1,577 @@
+/*
+ * Host build of the routing protocol: Contiki/Rime stand-ins.
+ * See host.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "lib/memb.h"
+#include "lib/random.h"
+
+/*---------------------------------------------------------------------------*/
+host_time_t host_now;
+int host_node;
+const struct host_driver *host_driver;
+
+unsigned long host_unicast_sends;
+unsigned long host_broadcast_sends;
+
+/*---------------------------------------------------------------------------*/
+/*                                 Event queue                               */
+/*---------------------------------------------------------------------------*/
+struct host_event {
+  host_time_t at;
+  uint32_t seq;
+  int node;
+  void (* fn)(void *);
+  void *arg;
+  struct ctimer *ct; /* set for ctimer events */
+  uint32_t gen;
+};
+
+static struct host_event *heap;
+static size_t heap_len, heap_cap;
+static uint32_t heap_seq;
+
+static int
+event_before(const struct host_event *a, const struct host_event *b)
+{
+  if(a->at != b->at) {
+    return a->at < b->at;
+  }
+  return a->seq < b->seq;
+}
+
+static void
+heap_push(const struct host_event *ev)
+{
+  size_t i;
+
+  if(heap_len == heap_cap) {
+    heap_cap = heap_cap ? heap_cap * 2 : 1024;
+    heap = realloc(heap, heap_cap * sizeof(*heap));
+    if(heap == NULL) {
+      fprintf(stderr, "host: out of memory for event queue\n");
+      exit(1);
+    }
+  }
+
+  i = heap_len++;
+  heap[i] = *ev;
+  heap[i].seq = heap_seq++;
+  while(i > 0 && event_before(&heap[i], &heap[(i - 1) / 2])) {
+    struct host_event tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static void
+heap_pop(struct host_event *out)
+{
+  size_t i = 0;
+
+  *out = heap[0];
+  heap[0] = heap[--heap_len];
+  for(;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if(l < heap_len && event_before(&heap[l], &heap[m])) m = l;
+    if(r < heap_len && event_before(&heap[r], &heap[m])) m = r;
+    if(m == i) break;
+    struct host_event tmp = heap[i];
+    heap[i] = heap[m];
+    heap[m] = tmp;
+    i = m;
+  }
+}
+
+void
+host_schedule(host_time_t at, int node, void (* fn)(void *), void *arg)
+{
+  struct host_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.at = at;
+  ev.node = node;
+  ev.fn = fn;
+  ev.arg = arg;
+  heap_push(&ev);
+}
+
+unsigned long
+host_run(host_time_t until)
+{
+  unsigned long n = 0;
+  struct host_event ev;
+
+  while(heap_len > 0 && heap[0].at <= until) {
+    heap_pop(&ev);
+
+    if(ev.ct != NULL) {
+      /* Stale entry of a ctimer that was stopped or re-armed */
+      if(!ev.ct->active || ev.ct->gen != ev.gen) {
+        continue;
+      }
+      ev.ct->active = 0;
+      ev.fn = ev.ct->f;
+      ev.arg = ev.ct->ptr;
+    }
+
+    if(ev.at > host_now) {
+      host_now = ev.at;
+    }
+    host_node = ev.node;
+    if(host_driver != NULL && host_driver->enter != NULL) {
+      host_driver->enter(ev.node);
+    }
+    ev.fn(ev.arg);
+    n++;
+  }
+
+  if(host_now < until) {
+    host_now = until;
+  }
+  return n;
+}
+
+void
+host_reset(void)
+{
+  heap_len = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                 Clock, ctimer                             */
+/*---------------------------------------------------------------------------*/
+clock_time_t
+clock_time(void)
+{
+  return (clock_time_t)(host_now * CLOCK_SECOND / HOST_SECOND);
+}
+
+unsigned long
+clock_seconds(void)
+{
+  return (unsigned long)(host_now / HOST_SECOND);
+}
+
+static void
+ctimer_arm(struct ctimer *c)
+{
+  struct host_event ev;
+
+  c->gen++;
+  c->active = 1;
+  c->owner = host_node;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.at = c->start + HOST_TICKS_TO_US(c->interval);
+  ev.node = host_node;
+  ev.ct = c;
+  ev.gen = c->gen;
+  heap_push(&ev);
+}
+
+void
+ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr)
+{
+  c->f = f;
+  c->ptr = ptr;
+  c->start = host_now;
+  c->interval = t;
+  ctimer_arm(c);
+}
+
+void
+ctimer_reset(struct ctimer *c)
+{
+  /* Drift-free: the next period starts where the last one ended */
+  c->start += HOST_TICKS_TO_US(c->interval);
+  ctimer_arm(c);
+}
+
+void
+ctimer_restart(struct ctimer *c)
+{
+  c->start = host_now;
+  ctimer_arm(c);
+}
+
+void
+ctimer_stop(struct ctimer *c)
+{
+  c->active = 0;
+  c->gen++;
+}
+
+int
+ctimer_expired(struct ctimer *c)
+{
+  return !c->active;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                    random                                 */
+/*---------------------------------------------------------------------------*/
+static uint32_t rand_state = 1;
+
+void
+random_init(unsigned short seed)
+{
+  rand_state = seed ? seed : 1;
+}
+
+unsigned short
+random_rand(void)
+{
+  /* xorshift32, plenty for jitter and destination choice */
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return (unsigned short)(rand_state >> 8);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                     memb                                  */
+/*---------------------------------------------------------------------------*/
+void
+memb_init(struct memb *m)
+{
+  memset(m->count, 0, m->num);
+  memset(m->mem, 0, (size_t)m->size * m->num);
+}
+
+void *
+memb_alloc(struct memb *m)
+{
+  int i;
+
+  for(i = 0; i < m->num; ++i) {
+    if(m->count[i] == 0) {
+      ++(m->count[i]);
+      return (void *)((char *)m->mem + (i * m->size));
+    }
+  }
+  return NULL;
+}
+
+char
+memb_free(struct memb *m, void *ptr)
+{
+  int i;
+  char *ptr2 = (char *)m->mem;
+
+  for(i = 0; i < m->num; ++i) {
+    if(ptr2 == (char *)ptr) {
+      if(m->count[i] > 0) {
+        --(m->count[i]);
+      }
+      return m->count[i];
+    }
+    ptr2 += m->size;
+  }
+  return -1;
+}
+
+int
+memb_inmemb(struct memb *m, void *ptr)
+{
+  return (char *)ptr >= (char *)m->mem &&
+    (char *)ptr < (char *)m->mem + (m->num * m->size);
+}
+
+int
+memb_numfree(struct memb *m)
+{
+  int i, num_free = 0;
+
+  for(i = 0; i < m->num; ++i) {
+    if(m->count[i] == 0) {
+      ++num_free;
+    }
+  }
+  return num_free;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                   linkaddr                                */
+/*---------------------------------------------------------------------------*/
+linkaddr_t linkaddr_node_addr;
+const linkaddr_t linkaddr_null = { { 0, 0 } };
+
+void
+linkaddr_copy(linkaddr_t *dest, const linkaddr_t *src)
+{
+  memcpy(dest, src, LINKADDR_SIZE);
+}
+
+int
+linkaddr_cmp(const linkaddr_t *addr1, const linkaddr_t *addr2)
+{
+  return memcmp(addr1, addr2, LINKADDR_SIZE) == 0;
+}
+
+void
+linkaddr_set_node_addr(linkaddr_t *t)
+{
+  linkaddr_copy(&linkaddr_node_addr, t);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                   packetbuf                               */
+/*---------------------------------------------------------------------------*/
+static uint8_t packetbuf[PACKETBUF_HDR_SIZE + PACKETBUF_SIZE];
+static uint16_t buflen, bufptr;
+static uint8_t hdrptr;
+static packetbuf_attr_t attrs[PACKETBUF_ATTR_MAX];
+static linkaddr_t addrs[PACKETBUF_ADDR_MAX];
+
+void
+packetbuf_clear(void)
+{
+  buflen = bufptr = 0;
+  hdrptr = PACKETBUF_HDR_SIZE;
+  memset(attrs, 0, sizeof(attrs));
+  memset(addrs, 0, sizeof(addrs));
+}
+
+void *
+packetbuf_dataptr(void)
+{
+  return &packetbuf[bufptr + PACKETBUF_HDR_SIZE];
+}
+
+void *
+packetbuf_hdrptr(void)
+{
+  return &packetbuf[hdrptr];
+}
+
+uint16_t
+packetbuf_datalen(void)
+{
+  return buflen;
+}
+
+uint8_t
+packetbuf_hdrlen(void)
+{
+  return PACKETBUF_HDR_SIZE - hdrptr;
+}
+
+uint16_t
+packetbuf_totlen(void)
+{
+  return packetbuf_hdrlen() + packetbuf_datalen();
+}
+
+void
+packetbuf_set_datalen(uint16_t len)
+{
+  buflen = len;
+}
+
+int
+packetbuf_copyfrom(const void *from, uint16_t len)
+{
+  uint16_t l;
+
+  packetbuf_clear();
+  l = len > PACKETBUF_SIZE ? PACKETBUF_SIZE : len;
+  memcpy(&packetbuf[PACKETBUF_HDR_SIZE], from, l);
+  buflen = l;
+  return l;
+}
+
+int
+packetbuf_copyto(void *to)
+{
+  memcpy(to, &packetbuf[hdrptr], packetbuf_hdrlen());
+  memcpy((uint8_t *)to + packetbuf_hdrlen(), packetbuf_dataptr(), buflen);
+  return packetbuf_totlen();
+}
+
+int
+packetbuf_hdralloc(int size)
+{
+  if(hdrptr >= size && packetbuf_totlen() + size <= PACKETBUF_SIZE) {
+    hdrptr -= size;
+    return 1;
+  }
+  return 0;
+}
+
+int
+packetbuf_hdrreduce(int size)
+{
+  if(buflen < size) {
+    return 0;
+  }
+  bufptr += size;
+  buflen -= size;
+  return 1;
+}
+
+void
+packetbuf_compact(void)
+{
+  uint8_t tmp[PACKETBUF_HDR_SIZE + PACKETBUF_SIZE];
+  int len = packetbuf_copyto(tmp);
+  packetbuf_attr_t a[PACKETBUF_ATTR_MAX];
+  linkaddr_t ad[PACKETBUF_ADDR_MAX];
+
+  memcpy(a, attrs, sizeof(a));
+  memcpy(ad, addrs, sizeof(ad));
+  packetbuf_copyfrom(tmp, len);
+  memcpy(attrs, a, sizeof(a));
+  memcpy(addrs, ad, sizeof(ad));
+}
+
+int
+packetbuf_set_attr(uint8_t type, const packetbuf_attr_t val)
+{
+  attrs[type] = val;
+  return 1;
+}
+
+packetbuf_attr_t
+packetbuf_attr(uint8_t type)
+{
+  return attrs[type];
+}
+
+int
+packetbuf_set_addr(uint8_t type, const linkaddr_t *addr)
+{
+  linkaddr_copy(&addrs[type], addr);
+  return 1;
+}
+
+const linkaddr_t *
+packetbuf_addr(uint8_t type)
+{
+  return &addrs[type];
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                   queuebuf                                */
+/*---------------------------------------------------------------------------*/
+struct queuebuf {
+  uint8_t data[PACKETBUF_HDR_SIZE + PACKETBUF_SIZE];
+  uint16_t len;
+  packetbuf_attr_t attrs[PACKETBUF_ATTR_MAX];
+  linkaddr_t addrs[PACKETBUF_ADDR_MAX];
+};
+
+MEMB(bufmem, struct queuebuf, QUEUEBUF_NUM);
+static int bufmem_ready;
+
+struct queuebuf *
+queuebuf_new_from_packetbuf(void)
+{
+  struct queuebuf *b;
+
+  if(!bufmem_ready) {
+    memb_init(&bufmem);
+    bufmem_ready = 1;
+  }
+  b = memb_alloc(&bufmem);
+  if(b != NULL) {
+    b->len = packetbuf_copyto(b->data);
+    memcpy(b->attrs, attrs, sizeof(attrs));
+    memcpy(b->addrs, addrs, sizeof(addrs));
+  }
+  return b;
+}
+
+void
+queuebuf_to_packetbuf(struct queuebuf *b)
+{
+  packetbuf_copyfrom(b->data, b->len);
+  memcpy(attrs, b->attrs, sizeof(attrs));
+  memcpy(addrs, b->addrs, sizeof(addrs));
+}
+
+void
+queuebuf_free(struct queuebuf *b)
+{
+  memb_free(&bufmem, b);
+}
+
+linkaddr_t *
+queuebuf_addr(struct queuebuf *b, uint8_t type)
+{
+  return &b->addrs[type];
+}
+
+int
+queuebuf_numfree(void)
+{
+  if(!bufmem_ready) {
+    return QUEUEBUF_NUM;
+  }
+  return memb_numfree(&bufmem);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                              broadcast, unicast                           */
+/*---------------------------------------------------------------------------*/
+void
+broadcast_open(struct broadcast_conn *c, uint16_t channel,
+               const struct broadcast_callbacks *u)
+{
+  c->channel = channel;
+  c->u = u;
+  if(host_driver != NULL && host_driver->broadcast_open != NULL) {
+    host_driver->broadcast_open(c);
+  }
+}
+
+void
+broadcast_close(struct broadcast_conn *c)
+{
+  (void)c;
+}
+
+int
+broadcast_send(struct broadcast_conn *c)
+{
+  host_broadcast_sends++;
+  if(host_driver != NULL && host_driver->broadcast_send != NULL) {
+    return host_driver->broadcast_send(c);
+  }
+  return 1;
+}
+
+void
+unicast_open(struct unicast_conn *c, uint16_t channel,
+             const struct unicast_callbacks *u)
+{
+  c->c.channel = channel;
+  c->c.u = NULL;
+  c->u = u;
+  if(host_driver != NULL && host_driver->unicast_open != NULL) {
+    host_driver->unicast_open(c);
+  }
+}
+
+void
+unicast_close(struct unicast_conn *c)
+{
+  (void)c;
+}
+
+int
+unicast_send(struct unicast_conn *c, const linkaddr_t *receiver)
+{
+  host_unicast_sends++;
+  packetbuf_set_addr(PACKETBUF_ADDR_RECEIVER, receiver);
+  packetbuf_set_addr(PACKETBUF_ADDR_SENDER, &linkaddr_node_addr);
+  if(host_driver != NULL && host_driver->unicast_send != NULL) {
+    return host_driver->unicast_send(c, receiver);
+  }
+  return 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * Host build of the routing protocol.
+ *
+ * contiki-host.c implements the small part of Contiki/Rime that rp.c uses
+ * (clock, ctimer, random, memb, packetbuf, queuebuf, broadcast, unicast) on
+ * top of one discrete-event queue. A driver (the benchmark or the network
+ * simulator) plugs in the radio side through struct host_driver.
+ */
+#ifndef HOST_H_
+#define HOST_H_
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+
+/*---------------------------------------------------------------------------*/
+/* Radio side of the Rime primitives, supplied by the driver */
+struct host_driver {
+  int (* broadcast_send)(struct broadcast_conn *c);
+  int (* unicast_send)(struct unicast_conn *c, const linkaddr_t *receiver);
+  void (* broadcast_open)(struct broadcast_conn *c);
+  void (* unicast_open)(struct unicast_conn *c);
+  /* Called before an event of `node` runs, to switch node context */
+  void (* enter)(int node);
+};
+
+extern const struct host_driver *host_driver;
+
+/*---------------------------------------------------------------------------*/
+/* Simulated time (microseconds, clock_time() is derived from it) and the
+   node whose code is currently running */
+typedef uint64_t host_time_t;
+#define HOST_SECOND 1000000ULL
+#define HOST_TICKS_TO_US(t) ((host_time_t)(t) * HOST_SECOND / CLOCK_SECOND)
+
+extern host_time_t host_now;
+extern int host_node;
+
+/* Counters for the benchmark */
+extern unsigned long host_unicast_sends;
+extern unsigned long host_broadcast_sends;
+
+/*---------------------------------------------------------------------------*/
+/* Event queue */
+void host_schedule(host_time_t at, int node, void (* fn)(void *), void *arg);
+/* Run every event due at or before `until`, then set the clock to it */
+unsigned long host_run(host_time_t until);
+/* Drop all pending events (timers included) */
+void host_reset(void);
+
+#endif /* HOST_H_ */
@@ -0,0 +1,18 @@
+/*
+ * Host build of the routing protocol: minimal stand-in for the Contiki
+ * core header. Only what rp.c / the host drivers need is provided.
+ */
+#ifndef CONTIKI_H_
+#define CONTIKI_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sys/clock.h"
+#include "sys/ctimer.h"
+
+#ifdef PROJECT_CONF_H
+#include PROJECT_CONF_H
+#endif
+
+#endif /* CONTIKI_H_ */
@@ -0,0 +1,6 @@
+#ifndef NETSTACK_H_
+#define NETSTACK_H_
+
+#include "net/mac/mac.h"
+
+#endif /* NETSTACK_H_ */
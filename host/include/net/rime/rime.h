@@ -0,0 +1,105 @@
+/*
+ * Host build: the subset of the Rime stack used by rp.c. The radio side of
+ * broadcast/unicast is supplied by the host driver (see host/host.h).
+ */
+#ifndef RIME_H_
+#define RIME_H_
+
+#include <stdint.h>
+#include "core/net/linkaddr.h"
+#include "net/mac/mac.h"
+
+/*---------------------------------------------------------------------------*/
+/* packetbuf */
+#define PACKETBUF_SIZE 128
+#define PACKETBUF_HDR_SIZE 48
+
+typedef uint16_t packetbuf_attr_t;
+
+enum {
+  PACKETBUF_ATTR_NONE,
+  PACKETBUF_ATTR_RSSI,
+  PACKETBUF_ATTR_LINK_QUALITY,
+  PACKETBUF_ATTR_CHANNEL,
+  PACKETBUF_ATTR_MAX_MAC_TRANSMISSIONS,
+  PACKETBUF_ATTR_MAC_SEQNO,
+  PACKETBUF_ATTR_MAX,
+};
+
+enum {
+  PACKETBUF_ADDR_SENDER,
+  PACKETBUF_ADDR_RECEIVER,
+  PACKETBUF_ADDR_MAX,
+};
+
+void packetbuf_clear(void);
+void *packetbuf_dataptr(void);
+void *packetbuf_hdrptr(void);
+uint16_t packetbuf_datalen(void);
+uint8_t packetbuf_hdrlen(void);
+uint16_t packetbuf_totlen(void);
+void packetbuf_set_datalen(uint16_t len);
+int packetbuf_copyfrom(const void *from, uint16_t len);
+int packetbuf_copyto(void *to);
+int packetbuf_hdralloc(int size);
+int packetbuf_hdrreduce(int size);
+void packetbuf_compact(void);
+
+int packetbuf_set_attr(uint8_t type, const packetbuf_attr_t val);
+packetbuf_attr_t packetbuf_attr(uint8_t type);
+int packetbuf_set_addr(uint8_t type, const linkaddr_t *addr);
+const linkaddr_t *packetbuf_addr(uint8_t type);
+
+/*---------------------------------------------------------------------------*/
+/* queuebuf */
+#ifndef QUEUEBUF_CONF_NUM
+#define QUEUEBUF_CONF_NUM 8
+#endif
+#define QUEUEBUF_NUM QUEUEBUF_CONF_NUM
+
+struct queuebuf;
+struct queuebuf *queuebuf_new_from_packetbuf(void);
+void queuebuf_to_packetbuf(struct queuebuf *b);
+void queuebuf_free(struct queuebuf *b);
+linkaddr_t *queuebuf_addr(struct queuebuf *b, uint8_t type);
+int queuebuf_numfree(void);
+
+/*---------------------------------------------------------------------------*/
+/* broadcast */
+struct broadcast_conn;
+
+struct broadcast_callbacks {
+  void (* recv)(struct broadcast_conn *ptr, const linkaddr_t *sender);
+  void (* sent)(struct broadcast_conn *ptr, int status, int num_tx);
+};
+
+struct broadcast_conn {
+  uint16_t channel;
+  const struct broadcast_callbacks *u;
+};
+
+void broadcast_open(struct broadcast_conn *c, uint16_t channel,
+                    const struct broadcast_callbacks *u);
+void broadcast_close(struct broadcast_conn *c);
+int broadcast_send(struct broadcast_conn *c);
+
+/*---------------------------------------------------------------------------*/
+/* unicast */
+struct unicast_conn;
+
+struct unicast_callbacks {
+  void (* recv)(struct unicast_conn *c, const linkaddr_t *from);
+  void (* sent)(struct unicast_conn *ptr, int status, int num_tx);
+};
+
+struct unicast_conn {
+  struct broadcast_conn c;
+  const struct unicast_callbacks *u;
+};
+
+void unicast_open(struct unicast_conn *c, uint16_t channel,
+                  const struct unicast_callbacks *u);
+void unicast_close(struct unicast_conn *c);
+int unicast_send(struct unicast_conn *c, const linkaddr_t *receiver);
+
+#endif /* RIME_H_ */
@@ -0,0 +1,14 @@
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <stdint.h>
+
+/* Same tick rate as the sky and zoul platforms */
+#define CLOCK_SECOND 128
+
+typedef uint32_t clock_time_t;
+
+clock_time_t clock_time(void);
+unsigned long clock_seconds(void);
+
+#endif /* CLOCK_H_ */
@@ -0,0 +1,24 @@
+#ifndef CTIMER_H_
+#define CTIMER_H_
+
+#include "sys/clock.h"
+
+/* Callback timer. The host keeps every armed ctimer in one event heap,
+   tagged with the node that armed it (see host/host.h). */
+struct ctimer {
+  void (*f)(void *);
+  void *ptr;
+  uint64_t start;          /* host time (us), see host/host.h */
+  clock_time_t interval;
+  uint32_t gen;
+  int owner;
+  int active;
+};
+
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr);
+void ctimer_reset(struct ctimer *c);
+void ctimer_restart(struct ctimer *c);
+void ctimer_stop(struct ctimer *c);
+int ctimer_expired(struct ctimer *c);
+
+#endif /* CTIMER_H_ */
@@ -0,0 +1,1054 @@
+/*
+ * Discrete-event network simulator, host build.
+ *
+ * Runs N nodes of the unmodified rp.c together with the traffic pattern of
+ * app.c. Every node gets its own copy of rp.c (host/build/rp-node.so is
+ * loaded once per node), hence its own routing table and other globals.
+ *
+ * Radio: unit disk like Cooja's UDGM (transmitting/interference range,
+ * success ratio tx/rx), half duplex, collisions at the receiver, carrier
+ * sense, link-layer acks, retransmissions and duplicate detection like
+ * csma + nullrdc with autoack. Radio always on (nullrdc).
+ *
+ * The output files are those of the test_nogui_dc.csc script: the log
+ * ("<us><TAB>ID:n<TAB>line", same App: Send / App: Recv / Energest: lines)
+ * and the PowerTracker radio statistics (test_dc.log, reset after the
+ * settling time), so parser.py, analysis.py and energest-stats.py work on
+ * them unchanged.
+ *
+ *   make host-sim
+ *   host/build/rp-sim -n 500 -o test.log -D test_dc.log
+ *   host/build/rp-sim -c test_nogui_dc.csc -o test.log -D test_dc.log
+ */
+#include <dlfcn.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "lib/random.h"
+#include "rp.h"
+
+/*---------------------------------------------------------------------------*/
+/* app.c */
+#define MSG_PERIOD (30 * HOST_SECOND) /* default of -P */
+#define MSG_PERIOD_MAX(p) (2 * (p))     /* backed off, as app.c */
+#define COLLECT_CHANNEL 0xAA
+#define ENERGEST_PERIOD (15 * HOST_SECOND)
+
+typedef struct {
+  uint16_t seqn;
+} __attribute__((packed)) test_msg_t;
+
+/*---------------------------------------------------------------------------*/
+/* Radio and MAC model */
+#define BYTE_US 32              /* 250 kbit/s */
+#define PHY_OVERHEAD 6          /* preamble, SFD, length */
+#define MAC_OVERHEAD 13         /* 802.15.4 header + FCS, Rime channel */
+#define ACK_LEN 11              /* ack frame incl. PHY overhead */
+#define ACK_WAIT_US 864
+#define BACKOFF_UNIT_US 320
+#define MAC_QUEUE_LEN 8
+#define MAC_SEQNO_CACHE 8
+#define RTIMER_SECOND 32768
+#define CPU_PER_EVENT_US 300    /* rough cost of one callback on the mote */
+#define SETTLING_TIME (10 * HOST_SECOND) /* PowerTracker reset, as the .csc */
+
+struct sim_node;
+
+struct frame {
+  struct sim_node *src;
+  int bcast;
+  uint16_t channel;
+  linkaddr_t receiver;
+  uint8_t mac_seqno;
+  uint16_t len;
+  uint8_t data[PACKETBUF_HDR_SIZE + PACKETBUF_SIZE];
+  int attempts;
+  int tx_ok;                    /* passed success_ratio_tx */
+  int refs;
+  struct frame *next;           /* MAC queue of the sender */
+  /* nodes that started receiving this transmission */
+  struct sim_node **rx;
+  int nrx;
+};
+
+struct neighbor {
+  struct sim_node *node;
+  double dist;
+  int in_range;                 /* within transmitting range */
+};
+
+struct seqno_entry {
+  linkaddr_t sender;
+  uint8_t seqno;
+};
+
+struct sim_node {
+  int index;
+  int id;
+  linkaddr_t addr;
+  double x, y;
+
+  /* private copy of rp.c */
+  void *dl;
+  void (* rp_open)(struct rp_conn *, uint16_t, bool, const struct rp_callbacks *);
+  int (* rp_send)(struct rp_conn *, const linkaddr_t *);
+  struct rp_conn *conn;
+  struct broadcast_conn *bc[4];
+  int nbc;
+  struct unicast_conn *uc[4];
+  int nuc;
+
+  struct neighbor *nbr;         /* within interference range */
+  int nnbr;
+
+  /* MAC */
+  struct frame *q_head, *q_tail;
+  int qlen;
+  int tx_busy;
+  host_time_t tx_until;
+  uint8_t mac_seqno;
+  struct seqno_entry seqnos[MAC_SEQNO_CACHE];
+  int seqno_next;
+
+  /* receiver */
+  host_time_t rx_until;
+  struct frame *rx_frame;
+  int rx_corrupt;
+
+  /* app */
+  uint16_t seqn;
+  host_time_t period;           /* msg_period, longer while rp_send() says congested */
+  int dead;                     /* stopped by -k: radio and app off */
+
+  /* energest, PowerTracker */
+  uint64_t tx_us, rx_us, cpu_us;
+  uint64_t pt_tx, pt_rx;
+  uint64_t last_tx, last_cpu;
+  host_time_t last_energest;
+  unsigned energest_cnt;
+
+  /* log line being assembled */
+  char line[512];
+  size_t linelen;
+};
+
+/*---------------------------------------------------------------------------*/
+static struct sim_node *nodes;
+static int num_nodes;
+static FILE *log_out;
+
+static double tx_range = 50.0;
+static double int_range = 100.0;
+static double success_tx = 1.0;
+static double success_rx = 1.0;
+static int max_tx = 4;
+static int num_dests = 10;
+static host_time_t msg_period = MSG_PERIOD;
+
+#define MAX_KILLS 16
+static struct { int id; host_time_t at; } kills[MAX_KILLS];
+static int num_kills;
+
+static unsigned long stat_frames, stat_collisions, stat_app_sent, stat_app_recv;
+static host_time_t stat_converged; /* first time every node had a parent, 0 if never */
+
+/*---------------------------------------------------------------------------*/
+/*                                   Logging                                 */
+/*---------------------------------------------------------------------------*/
+/* rp.c prints with printf/puts/putchar. These definitions in the executable
+   take precedence over libc for the loaded copies of rp.c, so that every line
+   gets the Cooja time and ID prefix of the node that printed it. */
+static void
+node_putc(struct sim_node *n, char c)
+{
+  if(c != '\n') {
+    if(n->linelen < sizeof(n->line) - 1) {
+      n->line[n->linelen++] = c;
+    }
+    return;
+  }
+
+  n->line[n->linelen] = '\0';
+  fprintf(log_out, "%llu\tID:%d\t%s\n", (unsigned long long)host_now, n->id, n->line);
+  n->linelen = 0;
+}
+
+static struct sim_node *
+current_node(void)
+{
+  if(nodes == NULL || host_node < 0 || host_node >= num_nodes) {
+    return NULL;
+  }
+  return &nodes[host_node];
+}
+
+int
+vprintf(const char *fmt, va_list ap)
+{
+  char buf[512];
+  struct sim_node *n = current_node();
+  int len, i;
+
+  len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  if(n == NULL) {
+    return fputs(buf, stderr) < 0 ? -1 : len;
+  }
+  for(i = 0; buf[i] != '\0'; i++) {
+    node_putc(n, buf[i]);
+  }
+  return len;
+}
+
+int
+printf(const char *fmt, ...)
+{
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vprintf(fmt, ap);
+  va_end(ap);
+  return len;
+}
+
+int
+puts(const char *s)
+{
+  return printf("%s\n", s);
+}
+
+int
+putchar(int c)
+{
+  return printf("%c", c);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                Node context                               */
+/*---------------------------------------------------------------------------*/
+static void
+sim_enter(int node)
+{
+  if(node < 0) return; /* simulator event */
+  nodes[node].cpu_us += CPU_PER_EVENT_US;
+  linkaddr_copy(&linkaddr_node_addr, &nodes[node].addr);
+}
+
+static void
+sim_broadcast_open(struct broadcast_conn *c)
+{
+  struct sim_node *n = current_node();
+  if(n != NULL && n->nbc < 4) {
+    n->bc[n->nbc++] = c;
+  }
+}
+
+static void
+sim_unicast_open(struct unicast_conn *c)
+{
+  struct sim_node *n = current_node();
+  if(n != NULL && n->nuc < 4) {
+    n->uc[n->nuc++] = c;
+  }
+}
+
+static struct broadcast_conn *
+find_bc(struct sim_node *n, uint16_t channel)
+{
+  int i;
+  for(i = 0; i < n->nbc; i++) {
+    if(n->bc[i]->channel == channel) return n->bc[i];
+  }
+  return NULL;
+}
+
+static struct unicast_conn *
+find_uc(struct sim_node *n, uint16_t channel)
+{
+  int i;
+  for(i = 0; i < n->nuc; i++) {
+    if(n->uc[i]->c.channel == channel) return n->uc[i];
+  }
+  return NULL;
+}
+
+static double
+rand_unit(void)
+{
+  return random_rand() / (double)(RANDOM_RAND_MAX + 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                     MAC                                   */
+/*---------------------------------------------------------------------------*/
+static void mac_try(void *ptr);
+
+static void
+frame_unref(struct frame *f)
+{
+  if(--f->refs == 0) {
+    free(f->rx);
+    free(f);
+  }
+}
+
+static host_time_t
+airtime(uint16_t len)
+{
+  return (host_time_t)(len + PHY_OVERHEAD + MAC_OVERHEAD) * BYTE_US;
+}
+
+static void
+mac_schedule(struct sim_node *n, host_time_t delay)
+{
+  host_schedule(host_now + delay, n->index, mac_try, n);
+}
+
+/* Load a frame back into the packetbuf, as seen by the sent callbacks */
+static void
+frame_to_packetbuf(struct frame *f)
+{
+  packetbuf_copyfrom(f->data, f->len);
+  packetbuf_set_addr(PACKETBUF_ADDR_SENDER, &f->src->addr);
+  packetbuf_set_addr(PACKETBUF_ADDR_RECEIVER, &f->receiver);
+  packetbuf_set_attr(PACKETBUF_ATTR_MAC_SEQNO, f->mac_seqno);
+}
+
+/* Frame done (sent, acked or given up): report it and move on */
+static void
+mac_done(struct sim_node *n, struct frame *f, int status)
+{
+  if(f == n->q_head) {
+    n->q_head = f->next;
+    if(n->q_head == NULL) n->q_tail = NULL;
+    n->qlen--;
+  } else {
+    status = MAC_TX_ERR; /* never queued */
+  }
+
+  if(f->bcast) {
+    struct broadcast_conn *c = find_bc(n, f->channel);
+    if(c != NULL && c->u->sent != NULL) {
+      frame_to_packetbuf(f);
+      c->u->sent(c, status, f->attempts);
+    }
+  } else {
+    struct unicast_conn *c = find_uc(n, f->channel);
+    if(c != NULL && c->u->sent != NULL) {
+      frame_to_packetbuf(f);
+      c->u->sent(c, status, f->attempts);
+    }
+  }
+  frame_unref(f);
+
+  if(n->q_head != NULL) {
+    mac_schedule(n, BACKOFF_UNIT_US * (1 + random_rand() % 4));
+  }
+}
+
+static int
+is_duplicate(struct sim_node *r, struct frame *f)
+{
+  int i;
+  for(i = 0; i < MAC_SEQNO_CACHE; i++) {
+    if(linkaddr_cmp(&r->seqnos[i].sender, &f->src->addr)) {
+      if(r->seqnos[i].seqno == f->mac_seqno) return 1;
+      r->seqnos[i].seqno = f->mac_seqno;
+      return 0;
+    }
+  }
+  linkaddr_copy(&r->seqnos[r->seqno_next].sender, &f->src->addr);
+  r->seqnos[r->seqno_next].seqno = f->mac_seqno;
+  r->seqno_next = (r->seqno_next + 1) % MAC_SEQNO_CACHE;
+  return 0;
+}
+
+static void
+deliver(void *ptr)
+{
+  struct frame *f = ptr;
+  struct sim_node *r = current_node();
+  double dist = 0;
+  int i;
+
+  for(i = 0; i < r->nnbr; i++) {
+    if(r->nbr[i].node == f->src) dist = r->nbr[i].dist;
+  }
+
+  packetbuf_copyfrom(f->data, f->len);
+  /* UDGM signal strength: -10 dBm next to the sender, -100 at the edge */
+  packetbuf_set_attr(PACKETBUF_ATTR_RSSI,
+                     (packetbuf_attr_t)(int16_t)(-10 - 90 * dist / tx_range));
+  packetbuf_set_attr(PACKETBUF_ATTR_LINK_QUALITY, 105);
+  packetbuf_set_addr(PACKETBUF_ADDR_SENDER, &f->src->addr);
+  packetbuf_set_addr(PACKETBUF_ADDR_RECEIVER, &f->receiver);
+
+  if(f->bcast) {
+    struct broadcast_conn *c = find_bc(r, f->channel);
+    if(c != NULL && c->u->recv != NULL) c->u->recv(c, &f->src->addr);
+  } else {
+    struct unicast_conn *c = find_uc(r, f->channel);
+    if(c != NULL && c->u->recv != NULL) c->u->recv(c, &f->src->addr);
+  }
+  frame_unref(f);
+}
+
+static void
+tx_end(void *ptr)
+{
+  struct frame *f = ptr;
+  struct sim_node *n = f->src;
+  int i, acked = 0;
+
+  n->tx_busy = 0;
+
+  for(i = 0; i < f->nrx; i++) {
+    struct sim_node *r = f->rx[i];
+    int ok;
+
+    if(r->rx_frame != f || r->dead) continue;
+    r->rx_us += airtime(f->len);
+    ok = !r->rx_corrupt && f->tx_ok && rand_unit() < success_rx;
+    r->rx_frame = NULL;
+    if(!ok) continue;
+
+    if(f->bcast) {
+      f->refs++;
+      host_schedule(host_now, r->index, deliver, f);
+    } else if(linkaddr_cmp(&r->addr, &f->receiver)) {
+      /* autoack: the ack goes out even for a duplicate */
+      r->tx_us += ACK_LEN * BYTE_US;
+      acked = rand_unit() < success_rx;
+      if(!is_duplicate(r, f)) {
+        f->refs++;
+        host_schedule(host_now, r->index, deliver, f);
+      }
+    }
+  }
+
+  if(f->bcast) {
+    mac_done(n, f, MAC_TX_OK);
+  } else if(acked) {
+    mac_done(n, f, MAC_TX_OK);
+  } else if(f->attempts < max_tx) {
+    int be = f->attempts < 3 ? 3 + f->attempts : 5;
+    mac_schedule(n, ACK_WAIT_US + BACKOFF_UNIT_US * (random_rand() % (1 << be)));
+  } else {
+    mac_done(n, f, MAC_TX_NOACK);
+  }
+}
+
+static void
+tx_start(struct sim_node *n, struct frame *f)
+{
+  host_time_t end = host_now + airtime(f->len);
+  int i;
+
+  stat_frames++;
+  f->attempts++;
+  f->tx_ok = rand_unit() < success_tx;
+  f->nrx = 0;
+
+  n->tx_busy = 1;
+  n->tx_until = end;
+  n->tx_us += end - host_now;
+  if(n->rx_frame != NULL) {
+    n->rx_corrupt = 1; /* half duplex */
+  }
+
+  for(i = 0; i < n->nnbr; i++) {
+    struct sim_node *r = n->nbr[i].node;
+
+    if(r->tx_busy || r->dead) continue;
+    if(r->rx_until > host_now) {
+      /* already busy with another signal: both are lost */
+      if(r->rx_frame != NULL && !r->rx_corrupt) stat_collisions++;
+      r->rx_corrupt = 1;
+      if(end > r->rx_until) r->rx_until = end;
+      continue;
+    }
+    r->rx_until = end;
+    r->rx_corrupt = 0;
+    r->rx_frame = n->nbr[i].in_range ? f : NULL;
+    if(r->rx_frame != NULL) f->rx[f->nrx++] = r;
+  }
+
+  host_schedule(end, n->index, tx_end, f);
+}
+
+static void
+mac_try(void *ptr)
+{
+  struct sim_node *n = ptr;
+  struct frame *f = n->q_head;
+
+  if(f == NULL || n->tx_busy || n->dead) return;
+
+  /* Clear channel assessment */
+  if(n->rx_until > host_now) {
+    mac_schedule(n, (n->rx_until - host_now) + BACKOFF_UNIT_US * (1 + random_rand() % 8));
+    return;
+  }
+  tx_start(n, f);
+}
+
+/* Frame refused by a full MAC queue, reported like csma does */
+static void
+mac_reject(void *ptr)
+{
+  struct frame *f = ptr;
+  mac_done(f->src, f, MAC_TX_ERR);
+}
+
+static int
+mac_send(struct sim_node *n, int bcast, uint16_t channel, const linkaddr_t *receiver)
+{
+  struct frame *f;
+
+  f = calloc(1, sizeof(*f));
+  f->rx = calloc(n->nnbr ? n->nnbr : 1, sizeof(*f->rx));
+  if(f == NULL || f->rx == NULL) {
+    fprintf(stderr, "rp-sim: out of memory\n");
+    exit(1);
+  }
+  f->src = n;
+  f->bcast = bcast;
+  f->channel = channel;
+  f->mac_seqno = n->mac_seqno++;
+  packetbuf_set_attr(PACKETBUF_ATTR_MAC_SEQNO, f->mac_seqno); /* csma does it too */
+  f->refs = 1;
+  if(receiver != NULL) linkaddr_copy(&f->receiver, receiver);
+  f->len = packetbuf_copyto(f->data);
+
+  if(n->qlen >= MAC_QUEUE_LEN) {
+    host_schedule(host_now, n->index, mac_reject, f);
+    return 1;
+  }
+
+  if(n->q_tail != NULL) {
+    n->q_tail->next = f;
+  } else {
+    n->q_head = f;
+  }
+  n->q_tail = f;
+  n->qlen++;
+
+  if(n->q_head == f && !n->tx_busy) {
+    mac_schedule(n, BACKOFF_UNIT_US * (random_rand() % 8));
+  }
+  return 1;
+}
+
+static int
+sim_broadcast_send(struct broadcast_conn *c)
+{
+  if(current_node()->dead) return 0;
+  return mac_send(current_node(), 1, c->channel, NULL);
+}
+
+static int
+sim_unicast_send(struct unicast_conn *c, const linkaddr_t *receiver)
+{
+  if(current_node()->dead) return 0;
+  return mac_send(current_node(), 0, c->c.channel, receiver);
+}
+
+static const struct host_driver sim_driver = {
+  .broadcast_send = sim_broadcast_send,
+  .unicast_send = sim_unicast_send,
+  .broadcast_open = sim_broadcast_open,
+  .unicast_open = sim_unicast_open,
+  .enter = sim_enter,
+};
+
+/*---------------------------------------------------------------------------*/
+/*                           app.c and simple-energest                       */
+/*---------------------------------------------------------------------------*/
+static void
+app_recv(const linkaddr_t *originator, uint8_t hops)
+{
+  test_msg_t msg;
+
+  if(packetbuf_datalen() != sizeof(msg)) {
+    printf("App: wrong length: %d\n", packetbuf_datalen());
+    return;
+  }
+  memcpy(&msg, packetbuf_dataptr(), sizeof(msg));
+  printf("App: Recv from %02x:%02x seqn %d hops %d\n",
+         originator->u8[0], originator->u8[1], msg.seqn, hops);
+  stat_app_recv++;
+}
+
+static const struct rp_callbacks app_callbacks = { .recv = app_recv };
+
+static void
+app_send(void *ptr)
+{
+  struct sim_node *n = ptr;
+  test_msg_t msg = { .seqn = n->seqn };
+  linkaddr_t dest;
+  int id = (random_rand() % num_dests) + 1;
+  int ret;
+
+  if(n->dead) return;
+
+  dest.u8[0] = id & 0xFF;
+  dest.u8[1] = id >> 8;
+
+  packetbuf_clear();
+  memcpy(packetbuf_dataptr(), &msg, sizeof(msg));
+  packetbuf_set_datalen(sizeof(msg));
+
+  printf("App: Send seqn %d to %02x:%02x\n", msg.seqn, dest.u8[0], dest.u8[1]);
+  stat_app_sent++;
+
+  /* Back off as app.c does: a quarter longer when congested, back by a
+     quarter of the base period a send at a time */
+  ret = n->rp_send(n->conn, &dest);
+  if(ret == RP_SEND_CONGESTED || ret == 0) {
+    n->period = n->period + n->period / 4 < MSG_PERIOD_MAX(msg_period) ?
+                n->period + n->period / 4 : MSG_PERIOD_MAX(msg_period);
+  } else if(n->period > msg_period) {
+    n->period = n->period - msg_period / 4 > msg_period ? n->period - msg_period / 4 : msg_period;
+  }
+  n->seqn++;
+}
+
+static void
+app_period(void *ptr)
+{
+  struct sim_node *n = ptr;
+
+  host_schedule(host_now + n->period, n->index, app_period, n);
+  /* Random shift within the second half of the interval */
+  host_schedule(host_now + n->period / 2 +
+                (host_time_t)(rand_unit() * (n->period / 2)),
+                n->index, app_send, n);
+}
+
+static void
+energest_step(void *ptr)
+{
+  struct sim_node *n = ptr;
+  uint64_t elapsed = host_now - n->last_energest;
+  uint64_t cpu = n->cpu_us - n->last_cpu;
+  uint64_t tx = n->tx_us - n->last_tx;
+
+  if(cpu > elapsed) cpu = elapsed;
+  if(tx > elapsed) tx = elapsed;
+
+  /* radio always on (nullrdc): listening whenever not transmitting */
+  printf("Energest: %u %lu %lu %lu %lu\n", n->energest_cnt++,
+         (unsigned long)(cpu * RTIMER_SECOND / HOST_SECOND),
+         (unsigned long)((elapsed - cpu) * RTIMER_SECOND / HOST_SECOND),
+         (unsigned long)(tx * RTIMER_SECOND / HOST_SECOND),
+         (unsigned long)((elapsed - tx) * RTIMER_SECOND / HOST_SECOND));
+
+  n->last_energest = host_now;
+  n->last_cpu = n->cpu_us;
+  n->last_tx = n->tx_us;
+  host_schedule(host_now + ENERGEST_PERIOD, n->index, energest_step, n);
+}
+
+/* PowerTracker statistics in the format of radioStatistics() */
+static void
+write_radio_stats(const char *path)
+{
+  FILE *fp = fopen(path, "w");
+  host_time_t monitored = host_now - SETTLING_TIME;
+  int i;
+
+  if(fp == NULL) {
+    perror(path);
+    return;
+  }
+  for(i = 0; i < num_nodes; i++) {
+    struct sim_node *n = &nodes[i];
+    uint64_t tx = n->tx_us - n->pt_tx, rx = n->rx_us - n->pt_rx;
+
+    /* nullrdc: the radio is on all the time */
+    fprintf(fp, "Sky_%d MONITORED %llu us\n", n->id, (unsigned long long)monitored);
+    fprintf(fp, "Sky_%d ON %llu us %.2f %%\n", n->id, (unsigned long long)monitored, 100.0);
+    fprintf(fp, "Sky_%d TX %llu us %.2f %%\n", n->id, (unsigned long long)tx,
+            100.0 * tx / monitored);
+    fprintf(fp, "Sky_%d RX %llu us %.2f %%\n", n->id, (unsigned long long)rx,
+            100.0 * rx / monitored);
+    fprintf(fp, "Sky_%d INT 0 us 0.00 %%\n", n->id);
+  }
+  fclose(fp);
+}
+
+static void
+radio_stats_reset(void *ptr)
+{
+  int i;
+  (void)ptr;
+  for(i = 0; i < num_nodes; i++) {
+    nodes[i].pt_tx = nodes[i].tx_us;
+    nodes[i].pt_rx = nodes[i].rx_us;
+  }
+}
+
+/* -k: the node stops for good, what it had in the MAC queue stays there */
+static void
+node_kill(void *ptr)
+{
+  struct sim_node *n = ptr;
+
+  printf("App: node stopped\n");
+  n->dead = 1;
+}
+
+/* Sampled once a second until every normal node has a parent */
+static void
+convergence_check(void *ptr)
+{
+  int i;
+  (void)ptr;
+  for(i = 0; i < num_nodes; i++) {
+    if(nodes[i].id != 1 && !nodes[i].dead && linkaddr_cmp(&nodes[i].conn->parent, &linkaddr_null)) {
+      host_schedule(host_now + HOST_SECOND, -1, convergence_check, NULL);
+      return;
+    }
+  }
+  stat_converged = host_now;
+}
+
+static void
+node_boot(void *ptr)
+{
+  struct sim_node *n = ptr;
+  bool is_sink = n->id == 1;
+
+  n->last_energest = host_now;
+  host_schedule(host_now + ENERGEST_PERIOD, n->index, energest_step, n);
+
+  printf("App: I am %s %02x:%02x\n", is_sink ? "sink" : "normal node",
+         n->addr.u8[0], n->addr.u8[1]);
+  n->rp_open(n->conn, COLLECT_CHANNEL, is_sink, &app_callbacks);
+
+  /* Wait the message period before start sending messages */
+  n->period = msg_period;
+  host_schedule(host_now + msg_period, n->index, app_period, n);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                  Topology                                 */
+/*---------------------------------------------------------------------------*/
+/* Pull a numeric <tag>value</tag> out of a Cooja .csc fragment */
+static int
+xml_number(const char *s, const char *end, const char *tag, double *out)
+{
+  char open[64];
+  const char *p;
+
+  snprintf(open, sizeof(open), "<%s>", tag);
+  p = strstr(s, open);
+  if(p == NULL || (end != NULL && p > end)) return 0;
+  *out = strtod(p + strlen(open), NULL);
+  return 1;
+}
+
+static char *
+read_file(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  char *buf;
+  long len;
+
+  if(fp == NULL) return NULL;
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  buf = malloc(len + 1);
+  if(buf != NULL) {
+    len = fread(buf, 1, len, fp);
+    buf[len] = '\0';
+  }
+  fclose(fp);
+  return buf;
+}
+
+/* Nodes and radio medium from a Cooja simulation file */
+static int
+load_csc(const char *path, int override_medium)
+{
+  char *buf = read_file(path), *p;
+  double v;
+  int cap = 16;
+
+  if(buf == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  if(!override_medium) {
+    if(xml_number(buf, NULL, "transmitting_range", &v)) tx_range = v;
+    if(xml_number(buf, NULL, "interference_range", &v)) int_range = v;
+    if(xml_number(buf, NULL, "success_ratio_tx", &v)) success_tx = v;
+    if(xml_number(buf, NULL, "success_ratio_rx", &v)) success_rx = v;
+  }
+
+  nodes = calloc(cap, sizeof(*nodes));
+  num_nodes = 0;
+  for(p = strstr(buf, "<mote>"); p != NULL; p = strstr(p + 1, "<mote>")) {
+    const char *end = strstr(p, "</mote>");
+    struct sim_node *n;
+
+    if(num_nodes == cap) {
+      cap *= 2;
+      nodes = realloc(nodes, cap * sizeof(*nodes));
+      memset(nodes + num_nodes, 0, (cap - num_nodes) * sizeof(*nodes));
+    }
+    n = &nodes[num_nodes];
+    if(!xml_number(p, end, "x", &n->x) || !xml_number(p, end, "y", &n->y) ||
+       !xml_number(p, end, "id", &v)) {
+      continue;
+    }
+    n->id = (int)v;
+    num_nodes++;
+  }
+  free(buf);
+  return num_nodes;
+}
+
+/* Jittered grid, ~6 neighbors per node, the sink (id 1) in the middle */
+static void
+make_grid(int count)
+{
+  int side = (int)ceil(sqrt(count));
+  double spacing = 0.7 * tx_range;
+  int i, center = (side / 2) * side + side / 2, id = 2;
+
+  if(center >= count) center = count - 1;
+
+  nodes = calloc(count, sizeof(*nodes));
+  num_nodes = count;
+  for(i = 0; i < count; i++) {
+    nodes[i].x = (i % side) * spacing + (rand_unit() - 0.5) * 0.4 * spacing;
+    nodes[i].y = (i / side) * spacing + (rand_unit() - 0.5) * 0.4 * spacing;
+    nodes[i].id = i == center ? 1 : id++;
+  }
+}
+
+static void
+build_neighbors(void)
+{
+  int i, j;
+
+  for(i = 0; i < num_nodes; i++) {
+    struct sim_node *a = &nodes[i];
+    int cap = 8;
+
+    a->index = i;
+    a->addr.u8[0] = a->id & 0xFF;
+    a->addr.u8[1] = a->id >> 8;
+    a->nbr = malloc(cap * sizeof(*a->nbr));
+
+    for(j = 0; j < num_nodes; j++) {
+      double d = hypot(a->x - nodes[j].x, a->y - nodes[j].y);
+      if(j == i || d > int_range) continue;
+      if(a->nnbr == cap) {
+        cap *= 2;
+        a->nbr = realloc(a->nbr, cap * sizeof(*a->nbr));
+      }
+      a->nbr[a->nnbr].node = &nodes[j];
+      a->nbr[a->nnbr].dist = d;
+      a->nbr[a->nnbr].in_range = d <= tx_range;
+      a->nnbr++;
+    }
+  }
+}
+
+/* One private copy of rp.c per node: dlopen() maps a file once, so every
+   node loads its own copy of the shared object */
+static int
+load_nodes(const char *lib)
+{
+  char dir[] = "/tmp/rp-sim-XXXXXX";
+  char *image;
+  long len;
+  FILE *fp;
+  int i;
+
+  fp = fopen(lib, "rb");
+  if(fp == NULL) {
+    perror(lib);
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  image = malloc(len);
+  if(image == NULL || fread(image, 1, len, fp) != (size_t)len) {
+    fprintf(stderr, "rp-sim: cannot read %s\n", lib);
+    return -1;
+  }
+  fclose(fp);
+
+  if(mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return -1;
+  }
+
+  for(i = 0; i < num_nodes; i++) {
+    struct sim_node *n = &nodes[i];
+    char path[64];
+
+    snprintf(path, sizeof(path), "%s/rp-node-%d.so", dir, n->id);
+    fp = fopen(path, "wb");
+    if(fp == NULL || fwrite(image, 1, len, fp) != (size_t)len) {
+      perror(path);
+      return -1;
+    }
+    fclose(fp);
+
+    n->dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    unlink(path);
+    if(n->dl == NULL) {
+      fprintf(stderr, "rp-sim: %s\n", dlerror());
+      return -1;
+    }
+    n->rp_open = (void (*)(struct rp_conn *, uint16_t, bool, const struct rp_callbacks *))
+      dlsym(n->dl, "rp_open");
+    n->rp_send = (int (*)(struct rp_conn *, const linkaddr_t *))dlsym(n->dl, "rp_send");
+    n->conn = calloc(1, sizeof(struct rp_conn));
+    if(n->rp_open == NULL || n->rp_send == NULL || n->conn == NULL) {
+      fprintf(stderr, "rp-sim: bad node library %s\n", lib);
+      return -1;
+    }
+  }
+
+  rmdir(dir);
+  free(image);
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [options] > log\n"
+          "  -n nodes      jittered grid of this many nodes (default 10)\n"
+          "  -c file.csc   take nodes and radio medium from a Cooja file\n"
+          "  -t seconds    simulated time (default 1800, as the .csc timeout)\n"
+          "  -r range      transmitting range (default 50)\n"
+          "  -i range      interference range (default 100)\n"
+          "  -p ratio      success ratio tx (default 1.0)\n"
+          "  -q ratio      success ratio rx (default 1.0)\n"
+          "  -m tx         max transmissions per unicast frame (default 4)\n"
+          "  -d dests      destinations are ids 1..dests, as app.c (default 10)\n"
+          "  -P seconds    message period of every node (default 30, as app.c)\n"
+          "  -k id:seconds node id stops at that time (repeatable)\n"
+          "  -s seed       random seed (default 1)\n"
+          "  -L lib        node library (default rp-node.so next to %s)\n"
+          "  -o file       write the log there instead of stdout\n"
+          "  -D file       write the PowerTracker statistics (test_dc.log)\n",
+          prog, prog);
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *csc = NULL, *lib = NULL, *out = NULL, *dc = NULL;
+  char libpath[1024];
+  int count = 10, opt, i, medium_set = 0;
+  unsigned seed = 1;
+  double seconds = 1800;
+  struct timespec t0, t1;
+  unsigned long events;
+
+  while((opt = getopt(argc, argv, "n:c:t:r:i:p:q:m:d:P:k:s:L:o:D:h")) != -1) {
+    switch(opt) {
+    case 'n': count = atoi(optarg); break;
+    case 'c': csc = optarg; break;
+    case 't': seconds = atof(optarg); break;
+    case 'r': tx_range = atof(optarg); medium_set = 1; break;
+    case 'i': int_range = atof(optarg); medium_set = 1; break;
+    case 'p': success_tx = atof(optarg); medium_set = 1; break;
+    case 'q': success_rx = atof(optarg); medium_set = 1; break;
+    case 'm': max_tx = atoi(optarg); break;
+    case 'd': num_dests = atoi(optarg); break;
+    case 'P': msg_period = (host_time_t)(atof(optarg) * HOST_SECOND); break;
+    case 'k':
+      if(num_kills < MAX_KILLS && strchr(optarg, ':') != NULL) {
+        kills[num_kills].id = atoi(optarg);
+        kills[num_kills].at = (host_time_t)(atof(strchr(optarg, ':') + 1) * HOST_SECOND);
+        num_kills++;
+      }
+      break;
+    case 's': seed = (unsigned)atoi(optarg); break;
+    case 'L': lib = optarg; break;
+    case 'o': out = optarg; break;
+    case 'D': dc = optarg; break;
+    default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if(lib == NULL) {
+    const char *slash = strrchr(argv[0], '/');
+    snprintf(libpath, sizeof(libpath), "%.*srp-node.so",
+             slash ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+    lib = libpath;
+  }
+
+  log_out = stdout;
+  if(out != NULL && (log_out = fopen(out, "w")) == NULL) {
+    perror(out);
+    return 1;
+  }
+
+  host_node = -1;
+  random_init(seed);
+
+  if(csc != NULL) {
+    if(load_csc(csc, medium_set) <= 0) return 1;
+  } else {
+    if(count < 1) {
+      usage(argv[0]);
+      return 1;
+    }
+    make_grid(count);
+  }
+  if(int_range < tx_range) int_range = tx_range;
+  build_neighbors();
+  if(load_nodes(lib) < 0) return 1;
+
+  host_driver = &sim_driver;
+  for(i = 0; i < num_nodes; i++) {
+    host_schedule((host_time_t)(rand_unit() * HOST_SECOND), i, node_boot, &nodes[i]);
+  }
+  host_schedule(SETTLING_TIME, -1, radio_stats_reset, NULL);
+  host_schedule(HOST_SECOND, -1, convergence_check, NULL);
+  for(i = 0; i < num_kills; i++) {
+    int k;
+    for(k = 0; k < num_nodes; k++) {
+      if(nodes[k].id == kills[i].id) host_schedule(kills[i].at, k, node_kill, &nodes[k]);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  events = host_run((host_time_t)(seconds * HOST_SECOND));
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fflush(log_out);
+
+  host_node = -1;
+  if(dc != NULL) write_radio_stats(dc);
+  fprintf(stderr,
+          "rp-sim: %d nodes, %.0f s simulated in %.2f s, %lu events\n"
+          "rp-sim: converged at %.0f s\n"
+          "rp-sim: %lu frames, %lu collisions, app sent %lu recv %lu (%.1f%%)\n",
+          num_nodes, seconds,
+          (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, events,
+          stat_converged ? (double)stat_converged / HOST_SECOND : -1.0,
+          stat_frames, stat_collisions, stat_app_sent, stat_app_recv,
+          stat_app_sent ? 100.0 * stat_app_recv / stat_app_sent : 0.0);
+  return 0;
+}
@@ -9,31 +9,454 @@
 
 /*---------------------------------------------------------------------------*/
 /* Initial values */
-static routing_entry_node_t *routing_table = NULL;
+/* Pool for the routing table entries, a slot is in use if route_used[] */
+static routing_entry_t routes[MAX_ROUTES];
+static uint8_t route_used[MAX_ROUTES];
+static struct route_pool_stats route_pool;
+
+/* Destination index: open addressing (linear probing) over a fixed bucket
+   array. A bucket holds the pool slot of the entry, or ROUTE_SLOT_EMPTY. */
+#define ROUTE_BUCKETS (1u << ROUTE_BUCKET_BITS)
+#if MAX_ROUTES < 0xFF
+typedef uint8_t route_slot_t;     // one byte per bucket on the motes
+#define ROUTE_SLOT_EMPTY 0xFF
+#else
+typedef uint16_t route_slot_t;    // big tables of the host benchmark
+#define ROUTE_SLOT_EMPTY 0xFFFF
+#endif
+#if ROUTE_BUCKETS <= MAX_ROUTES
+#error "ROUTE_BUCKET_BITS too small for MAX_ROUTES"
+#endif
+static route_slot_t route_index[ROUTE_BUCKETS];
+
+/* Free pool slots, a stack: taking or giving back a slot is O(1) */
+static route_slot_t route_free_slots[MAX_ROUTES];
+static uint16_t route_free_top;
+
+/* Full topology report of a child being applied: by pool slot, the routes
+   through the child not (yet) in the report (see update_routing_table()) */
+static uint8_t route_stale[(MAX_ROUTES + 7) / 8];
+#define ROUTE_STALE(i) (route_stale[(i) >> 3] & (1 << ((i) & 7)))
+#define ROUTE_STALE_SET(i) (route_stale[(i) >> 3] |= 1 << ((i) & 7))
+#define ROUTE_STALE_CLEAR(i) (route_stale[(i) >> 3] &= ~(1 << ((i) & 7)))
+
+/* Current ROUTE_PARENT entry, for the lookup_route() fallback */
+static routing_entry_t *parent_route = NULL;
+
+/* Age of a route in seconds, safe across the timestamp wrap */
+static route_time_t
+route_age(const routing_entry_t *e, route_time_t now)
+{
+  return (route_time_t)(now - e->last_updated);
+}
+
+/* Entry in pool slot i, NULL if the slot is free */
+static routing_entry_t *
+route_slot(uint16_t i)
+{
+  if (!route_used[i]) return NULL;
+  return &routes[i];
+}
 
 /*---------------------------------------------------------------------------*/
 // Function to print the routing table for debugging purposes
 void print_routing_table(void) {
-  routing_entry_node_t *current = routing_table;
+  uint16_t i;
   printf("RT [Node %02x:%02x] Routing Table:\n", linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1]);
-  while (current != NULL) {
-    printf("RT [Node %02x:%02x] Destination: %02x:%02x, Next Hop: %02x:%02x, Type: %d, Last Updated: %" PRIu32 "\n",
+  for (i = 0; i < MAX_ROUTES; i++) {
+    routing_entry_t *e = route_slot(i);
+    if (e == NULL) continue;
+    printf("RT [Node %02x:%02x] Destination: %02x:%02x, Next Hop: %02x:%02x, Type: %d, Last Updated: %u\n",
            linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
-           current->entry.destination.u8[0], current->entry.destination.u8[1],
-           current->entry.next_hop.u8[0], current->entry.next_hop.u8[1],
-           current->entry.type, current->entry.last_updated);
-    current = current->next;
+           e->destination.u8[0], e->destination.u8[1],
+           e->next_hop.u8[0], e->next_hop.u8[1],
+           e->type, (unsigned)e->last_updated);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*                            Routing table pool                             */
+/*---------------------------------------------------------------------------*/
+static bool route_direct; // the sink, with ROUTE_DIRECT: set in rp_open()
+
+/* Home bucket of a destination (Fibonacci hashing of the 2-byte address, or
+   the node id at the sink with ROUTE_DIRECT) */
+static uint16_t
+route_hash(const linkaddr_t *addr)
+{
+  uint16_t key = addr->u8[0] | ((uint16_t)addr->u8[1] << 8);
+
+  if (ROUTE_DIRECT && route_direct) return ROUTE_NODE_ID(addr) & (ROUTE_BUCKETS - 1);
+  return (uint16_t)(key * 40503u) >> (16 - ROUTE_BUCKET_BITS);
+}
+
+/* Bucket holding the destination, or -1 */
+static int
+route_find_bucket(const linkaddr_t *destination)
+{
+  uint16_t b = route_hash(destination);
+  uint16_t n;
+
+  for (n = 0; n < ROUTE_BUCKETS; n++) {
+    route_slot_t slot = route_index[b];
+    if (slot == ROUTE_SLOT_EMPTY) return -1;
+    if (linkaddr_cmp(&routes[slot].destination, destination)) return b;
+    b = (b + 1) & (ROUTE_BUCKETS - 1);
+  }
+  return -1;
+}
+
+/* Empty a bucket, shifting back the entries of the probe chain behind it
+   so that no tombstones are needed */
+static void
+route_index_remove(uint16_t hole)
+{
+  uint16_t b = hole;
+
+  for (;;) {
+    b = (b + 1) & (ROUTE_BUCKETS - 1);
+    route_slot_t slot = route_index[b];
+    if (slot == ROUTE_SLOT_EMPTY) break;
+
+    uint16_t home = route_hash(&routes[slot].destination);
+    // move it only if its home bucket is not cyclically in (hole, b]
+    if (((b - home) & (ROUTE_BUCKETS - 1)) >= ((b - hole) & (ROUTE_BUCKETS - 1))) {
+      route_index[hole] = slot;
+      hole = b;
+    }
+  }
+  route_index[hole] = ROUTE_SLOT_EMPTY;
+}
+
+static routing_entry_t *
+route_alloc(const linkaddr_t *destination)
+{
+  routing_entry_t *e;
+  route_slot_t slot;
+
+  if (route_free_top == 0) {
+    route_pool.alloc_fails++;
+    return NULL;
+  }
+  slot = route_free_slots[--route_free_top];
+  route_used[slot] = 1;
+  e = &routes[slot];
+
+  uint16_t b = route_hash(destination);
+  while (route_index[b] != ROUTE_SLOT_EMPTY) b = (b + 1) & (ROUTE_BUCKETS - 1);
+  route_index[b] = e - routes;
+  ROUTE_STALE_CLEAR(route_index[b]);
+  linkaddr_copy(&e->destination, destination);
+
+  route_pool.used++;
+  route_pool.allocs++;
+  if (route_pool.used > route_pool.high_water) route_pool.high_water = route_pool.used;
+  return e;
+}
+
+/* Find another parent entry if the cached one goes away (rare) */
+static void
+route_refresh_parent_cache(void)
+{
+  uint16_t i;
+  parent_route = NULL;
+  for (i = 0; i < MAX_ROUTES; i++) {
+    routing_entry_t *e = route_slot(i);
+    if (e != NULL && e->type == ROUTE_PARENT) {
+      parent_route = e;
+      return;
+    }
   }
 }
 
+static void
+route_free(routing_entry_t *e)
+{
+  int b = route_find_bucket(&e->destination);
+  if (b >= 0) route_index_remove(b);
+
+  route_slot_t slot = e - routes;
+  route_used[slot] = 0;
+  route_free_slots[route_free_top++] = slot;
+  route_pool.used--;
+
+  if (e == parent_route) route_refresh_parent_cache();
+}
+
+void
+route_pool_get_stats(struct route_pool_stats *stats)
+{
+  *stats = route_pool;
+}
+
+void
+print_route_pool_stats(void)
+{
+  printf("RT pool [Node %02x:%02x]: used %u/%u, high-water %u, alloc fails %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         route_pool.used, MAX_ROUTES, route_pool.high_water, route_pool.alloc_fails);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                               Neighbor Table                              */
 /*---------------------------------------------------------------------------*/
+static neighbor_entry_t neighbors[MAX_NEIGHBORS];
+static uint8_t neighbors_used;
+
+static neighbor_entry_t *
+neighbor_lookup(const linkaddr_t *addr)
+{
+  uint8_t i;
+  for (i = 0; i < neighbors_used; i++) 
+  {
+    if (linkaddr_cmp(&neighbors[i].addr, addr)) return &neighbors[i];
+  }
+  return NULL;
+}
+
+/* Free entry, or the one heard the longest ago (never the parent) */
+static neighbor_entry_t *
+neighbor_alloc(struct rp_conn *conn)
+{
+  route_time_t now = ROUTE_TIME_NOW();
+  neighbor_entry_t *n = NULL;
+  uint8_t i;
+
+  if (neighbors_used < MAX_NEIGHBORS) return &neighbors[neighbors_used++];
+
+  for (i = 0; i < MAX_NEIGHBORS; i++) 
+  {
+    if (linkaddr_cmp(&neighbors[i].addr, &conn->parent)) continue;
+    if (n == NULL || (route_time_t)(now - neighbors[i].last_seen) > (route_time_t)(now - n->last_seen)) 
+    {
+      n = &neighbors[i];
+    }
+  }
+  conn->nbr_stats.evictions++;
+  return n;
+}
+
+/* Smoothing: a new sample weighs alpha/16 */
+static int16_t
+ewma(int16_t old, int16_t sample, uint8_t alpha)
+{
+  return (int16_t)(((int32_t)old * (16 - alpha) + (int32_t)sample * alpha) / 16);
+}
+
+/* A beacon from addr: its signal and the path ETX it advertises */
+static neighbor_entry_t *
+neighbor_beacon(struct rp_conn *conn, const linkaddr_t *addr, int16_t rssi, uint8_t lqi, uint16_t path_etx)
+{
+  neighbor_entry_t *n = neighbor_lookup(addr);
+
+  if (n == NULL) 
+  {
+    n = neighbor_alloc(conn);
+    linkaddr_copy(&n->addr, addr);
+    n->rssi = rssi;
+    n->lqi = lqi;
+    n->etx = NEIGHBOR_ETX_INIT;
+    n->tx_samples = 0;
+    n->tx_fails = 0;
+    n->congested = false;
+    memset(n->summary, 0, sizeof(n->summary));
+  }
+  else 
+  {
+    n->rssi = ewma(n->rssi, rssi, NEIGHBOR_RSSI_ALPHA);
+    n->lqi = (uint8_t)ewma(n->lqi, lqi, NEIGHBOR_RSSI_ALPHA);
+  }
+  n->path_etx = path_etx;
+  n->last_seen = ROUTE_TIME_NOW();
+  return n;
+}
+
+/* The two bits of addr in a summary of `bytes` bytes. The bits in a smaller
+   summary are the bits in a bigger one modulo its size, so a summary folds
+   down to a smaller one */
+static void
+summary_bits(const linkaddr_t *addr, uint16_t bytes, uint16_t bits[2])
+{
+  uint16_t x = ((uint16_t)addr->u8[1] << 8) | addr->u8[0];
+  bits[0] = ((uint16_t)(x * 40503u) >> 4) % (bytes * 8);
+  bits[1] = ((uint16_t)(x * 23505u) >> 4) % (bytes * 8);
+}
+
+static bool
+summary_has(const uint8_t *summary, uint16_t bytes, const linkaddr_t *addr)
+{
+  uint16_t bits[2];
+  summary_bits(addr, bytes, bits);
+  return (summary[bits[0] >> 3] & (1 << (bits[0] & 7))) && (summary[bits[1] >> 3] & (1 << (bits[1] & 7)));
+}
+
+/* Summary of our own subtree (SUBTREE_FILTER_BYTES), a counting filter:
+   a bit is set while its count is not 0. A count that got to 15 stays there,
+   its bit stays set (a false positive at worst). */
+static void
+subtree_summary_add(struct rp_conn *conn, const linkaddr_t *addr)
+{
+  uint16_t bits[2];
+  uint8_t i, shift, count;
+
+  summary_bits(addr, SUBTREE_FILTER_BYTES, bits);
+  for (i = 0; i < 2; i++) 
+  {
+    shift = (bits[i] & 1) * 4;
+    count = (conn->subtree_counts[bits[i] >> 1] >> shift) & 0x0F;
+    if (count < 0x0F) conn->subtree_counts[bits[i] >> 1] += 1 << shift;
+    conn->subtree_summary[bits[i] >> 3] |= 1 << (bits[i] & 7);
+  }
+}
+
+static void
+subtree_summary_remove(struct rp_conn *conn, const linkaddr_t *addr)
+{
+  uint16_t bits[2];
+  uint8_t i, shift, count;
+
+  summary_bits(addr, SUBTREE_FILTER_BYTES, bits);
+  for (i = 0; i < 2; i++) 
+  {
+    shift = (bits[i] & 1) * 4;
+    count = (conn->subtree_counts[bits[i] >> 1] >> shift) & 0x0F;
+    if (count == 0 || count == 0x0F) continue;
+    conn->subtree_counts[bits[i] >> 1] -= 1 << shift;
+    if (count == 1) conn->subtree_summary[bits[i] >> 3] &= ~(1 << (bits[i] & 7));
+  }
+}
+
+/* Our summary folded down to the SUBTREE_SUMMARY_BYTES of a beacon */
+static void
+subtree_summary_fold(struct rp_conn *conn, uint8_t *out)
+{
+  const uint8_t *s = conn->subtree_summary;
+  uint16_t i;
+
+  memcpy(out, s, SUBTREE_SUMMARY_BYTES);
+  for (i = SUBTREE_SUMMARY_BYTES; i < SUBTREE_FILTER_BYTES; i++) out[i % SUBTREE_SUMMARY_BYTES] |= s[i];
+}
+
+/* Path ETX through the neighbor */
+static uint16_t
+neighbor_path_etx(const neighbor_entry_t *n)
+{
+  uint32_t etx = (uint32_t)n->path_etx + n->etx;
+  return etx >= ETX_INFINITE ? ETX_INFINITE : (uint16_t)etx;
+}
+
+/* The same as a parent candidate: a congested one costs more */
+static uint32_t
+neighbor_parent_cost(const neighbor_entry_t *n)
+{
+  return (uint32_t)neighbor_path_etx(n) + (n->congested ? CONGESTION_ETX_PENALTY : 0);
+}
+
+/* What a neighbor said last of its congestion, in a beacon or a data frame */
+static void
+neighbor_congestion(struct rp_conn *conn, const linkaddr_t *addr, bool congested)
+{
+  neighbor_entry_t *n = neighbor_lookup(addr);
+
+  if (!RP_CONGESTION || n == NULL || n->congested == congested) return;
+  n->congested = congested;
+  if (congested) conn->cong_stats.heard++;
+}
+
+static bool
+path_etx_moved(uint16_t old, uint16_t etx)
+{
+  return (old > etx ? old - etx : etx - old) >= PATH_ETX_CHANGE;
+}
+
+static void parent_failover(struct rp_conn *conn);
+static void forward_retarget(struct rp_conn *conn, const linkaddr_t *from, const linkaddr_t *to);
+
+/* Outcome of a unicast to addr */
+static void
+neighbor_tx(struct rp_conn *conn, const linkaddr_t *addr, int status, int num_tx)
+{
+  neighbor_entry_t *n = neighbor_lookup(addr);
+  uint16_t sample;
+
+  if (status == MAC_TX_OK) 
+  {
+    sample = num_tx * ETX_SCALE;
+    conn->nbr_stats.tx_ok++;
+  }
+  else if (status == MAC_TX_NOACK) 
+  {
+    sample = NEIGHBOR_ETX_NOACK;
+    conn->nbr_stats.tx_noack++;
+  }
+  else 
+  { // busy channel, deferred, queue full: says nothing about the link
+    if (status == MAC_TX_COLLISION) conn->nbr_stats.tx_collisions++;
+    return;
+  }
+
+  if (n == NULL) return;
+
+  if (n->tx_samples == 0) n->etx = sample;
+  else n->etx = (uint16_t)ewma(n->etx, sample, NEIGHBOR_ETX_ALPHA);
+  if (n->tx_samples < 0xFF) n->tx_samples++;
+
+  if (status == MAC_TX_OK) n->tx_fails = 0;
+  else if (n->tx_fails < 0xFF) n->tx_fails++;
+
+  // a parent that stopped acking: don't wait for the beacons to tell
+  if (!conn->is_sink && linkaddr_cmp(addr, &conn->parent) && n->tx_fails >= PARENT_FAIL_THRESHOLD) 
+  {
+    parent_failover(conn);
+    return;
+  }
+
+  // our own path goes through the parent link
+  if (!conn->is_sink && linkaddr_cmp(addr, &conn->parent) 
+      && path_etx_moved(conn->path_etx, neighbor_path_etx(n))) 
+  {
+    conn->path_etx = neighbor_path_etx(n);
+    beacon_trickle_reset(conn);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void trickle_fire_cb(void *ptr);
+static void beacon_trickle_start_cb(void *ptr);
+static void global_repair_cb(void *ptr);
+static void forward_sent(struct rp_conn *conn, int status);
+static void piggyback_acked(struct rp_conn *conn, const linkaddr_t *to);
+
+/* Unicast sent callback: feeds the link estimates, and the next data frame
+   to the MAC when this one was the head of the forwarding queue. The packetbuf
+   here is what the MAC kept, with the Rime headers in front, not our message:
+   the head is known by the MAC seqno, as csma finds its own queue entry.
+   Reports and the other control frames go to the same neighbors without the
+   queue. Only a callback from inside our unicast_send() comes before the
+   seqno, and then it can only be the head. */
+static void
+uc_sent(struct unicast_conn *uc_conn, int status, int num_tx)
+{
+  struct rp_conn* conn = (struct rp_conn*)(((uint8_t*)uc_conn) - offsetof(struct rp_conn, uc));
+  linkaddr_t to;
+
+  linkaddr_copy(&to, packetbuf_addr(PACKETBUF_ADDR_RECEIVER));
+  neighbor_tx(conn, &to, status, num_tx);
+  if (RP_PIGGYBACK && status == MAC_TX_OK) piggyback_acked(conn, &to);
+  if (conn->fwd_busy && linkaddr_cmp(&to, &conn->fwd_to) 
+      && (!conn->fwd_seqno_known || packetbuf_attr(PACKETBUF_ATTR_MAC_SEQNO) == conn->fwd_seqno)) 
+  {
+    forward_sent(conn, status);
+  }
+}
+
 struct broadcast_callbacks bc_cb = {
   .recv = bc_recv,
   .sent = NULL
 };
 struct unicast_callbacks uc_cb = {
   .recv = uc_recv,
-  .sent = NULL
+  .sent = uc_sent
 };
 
 /*---------------------------------------------------------------------------*/
@@ -43,13 +466,35 @@ rp_open( struct rp_conn* conn, uint16_t channels,
 {
   linkaddr_copy(&conn->parent, &linkaddr_null);
   conn->metric = is_sink ? 0 : 65535;  // Sink = 0, others start with high metric
+  conn->path_etx = is_sink ? 0 : ETX_INFINITE;
   conn->beacon_seqn = 0;
   conn->is_sink = is_sink;
   conn->callbacks = callbacks;
 
   // new! for the parent changes
   conn->last_parent_change = 0; 
-  conn->parent_stable_counter = 0;
+  conn->last_report_refresh = 0;
+
+  /* Beacons: Trickle starts with the first thing to advertise */
+  conn->trickle_i = 0;
+  conn->trickle_c = 0;
+  memset(&conn->beacon_stats, 0, sizeof(conn->beacon_stats));
+
+  /* Routing table starts empty, all entries back in the pool */
+  memset(routes, 0, sizeof(routes));
+  memset(route_used, 0, sizeof(route_used));
+  route_direct = ROUTE_DIRECT && is_sink; // the table is empty, the home buckets can change
+  for (route_free_top = 0; route_free_top < MAX_ROUTES; route_free_top++) 
+  { // slot 0 on top
+    route_free_slots[route_free_top] = MAX_ROUTES - 1 - route_free_top;
+  }
+  memset(route_index, 0xFF, sizeof(route_index)); // every bucket ROUTE_SLOT_EMPTY
+  memset(route_stale, 0, sizeof(route_stale));
+  parent_route = NULL;
+  memset(&route_pool, 0, sizeof(route_pool));
+
+  neighbors_used = 0;
+  memset(&conn->nbr_stats, 0, sizeof(conn->nbr_stats));
 
   broadcast_open(&conn->bc, channels, &bc_cb);
   unicast_open(&conn->uc, channels + 1, &uc_cb);
@@ -59,8 +504,11 @@ rp_open( struct rp_conn* conn, uint16_t channels,
   /* Beacon sending */
   if (conn->is_sink) 
   {
-    conn->current_beacon_interval = BEACON_INITIAL_INTERVAL;
-    ctimer_set(&conn->beacon_timer, conn->current_beacon_interval, beacon_timer_cb, conn);
+    ctimer_set(&conn->beacon_timer, BEACON_INITIAL_INTERVAL, beacon_trickle_start_cb, conn);
+    if (GLOBAL_REPAIR_INTERVAL > 0) 
+    {
+      ctimer_set(&conn->global_repair_timer, GLOBAL_REPAIR_INTERVAL, global_repair_cb, conn);
+    }
   }
 
   /* Start route cleanup timer for both sink and non-sink */
@@ -69,9 +517,49 @@ rp_open( struct rp_conn* conn, uint16_t channels,
 
   ctimer_set(&conn->cleanup_timer, cleanup_interval, cleanup_timer_callback, conn);
 
+  /* Nothing reported to a parent yet */
+  conn->reported_size = 0;
+  linkaddr_copy(&conn->reported_parent, &linkaddr_null);
+  conn->report_version = 0;
+  conn->reports_since_full = 0;
+  conn->report_force_full = true;
+  memset(conn->report_sync, 0, sizeof(conn->report_sync));
+  conn->report_sync_next = 0;
+  conn->report_timer_active = 0;
+  conn->report_gap = REPORT_BATCH_MAX / 2; // the fixed wait of before, until we learn the gap
+  conn->report_dirty = false;
+  conn->report_tokens = REPORT_BURST;
+  conn->report_token_time = clock_time();
+  memset(&conn->report_stats, 0, sizeof(conn->report_stats));
+  conn->pb_pending = 0;
+  memset(&conn->pb_stats, 0, sizeof(conn->pb_stats));
+  conn->fwd_head = 0;
+  conn->fwd_len = 0;
+  conn->fwd_busy = false;
+  linkaddr_copy(&conn->fwd_to, &linkaddr_null);
+  conn->fwd_seqno_known = false;
+  memset(&conn->fwd_stats, 0, sizeof(conn->fwd_stats));
+  conn->repair_qb = NULL;
+  memset(&conn->repair_stats, 0, sizeof(conn->repair_stats));
+  conn->flood_qb = NULL;
+  conn->congested = false;
+  conn->tx_fail_rate = 0;
+  memset(&conn->cong_stats, 0, sizeof(conn->cong_stats));
+  conn->data_seqn = 0;
+  conn->dup_cache_len = 0;
+  conn->dup_cache_next = 0;
+  memset(&conn->dup_stats, 0, sizeof(conn->dup_stats));
+  memset(&conn->rev_stats, 0, sizeof(conn->rev_stats));
+  memset(&conn->flood_stats, 0, sizeof(conn->flood_stats));
+  memset(&conn->loop_stats, 0, sizeof(conn->loop_stats));
+  memset(&conn->ns_stats, 0, sizeof(conn->ns_stats));
+
   /* Initialize subtree with self */
   conn->subtree_size = 1;
   linkaddr_copy(&conn->subtree[0], &linkaddr_node_addr);
+  memset(conn->subtree_summary, 0, sizeof(conn->subtree_summary));
+  memset(conn->subtree_counts, 0, sizeof(conn->subtree_counts));
+  subtree_summary_add(conn, &linkaddr_node_addr);
   add_route(conn, &linkaddr_node_addr, &linkaddr_node_addr, ROUTE_SELF, 0, 0);
   
   /* Initialize toology report timer */
@@ -86,13 +574,98 @@ rp_open( struct rp_conn* conn, uint16_t channels,
 
 }
 
+/*---------------------------------------------------------------------------*/
+/*                                 Piggyback                                 */
+/*---------------------------------------------------------------------------*/
+/* Control messages waiting for a frame to ride on */
+#define PB_ADD_CHILD    0x01
+#define PB_REMOVE_CHILD 0x02
+#define PB_REPORT       0x04
+
+void send_add_child(struct unicast_conn *uc, const linkaddr_t *to);
+void send_remove_child(struct unicast_conn *uc, const linkaddr_t *to, const linkaddr_t *child_to_remove);
+static void send_topology_report_now(struct rp_conn *conn, char* lol);
+static void report_mark_dirty(struct rp_conn *conn, char* lol);
+static void report_send_now(struct rp_conn *conn, char* lol);
+static void beacon_parent_recv(struct rp_conn *conn, const linkaddr_t *sender, const linkaddr_t *their_parent);
+static void piggyback_attach(struct rp_conn *conn, const linkaddr_t *next_hop);
+
+/* Deadline: send on its own what is still pending */
+static void
+piggyback_deadline_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+  uint8_t pending = conn->pb_pending;
+  conn->pb_pending = 0;
+
+  if (pending & PB_REMOVE_CHILD) 
+  {
+    send_remove_child(&conn->uc, &conn->pb_old_parent, &linkaddr_node_addr);
+    conn->pb_stats.standalone++;
+  }
+  if (linkaddr_cmp(&conn->parent, &linkaddr_null)) return;
+
+  if (pending & PB_ADD_CHILD) 
+  {
+    send_add_child(&conn->uc, &conn->parent);
+    conn->pb_stats.standalone++;
+  }
+  if (pending & PB_REPORT) 
+  {
+    send_topology_report_now(conn, "piggyback deadline");
+    conn->pb_stats.standalone++;
+  }
+}
+
+/* Wait for a frame to carry it, at most PIGGYBACK_DEADLINE */
+static void
+piggyback_defer(struct rp_conn *conn, uint8_t what)
+{
+  if (conn->pb_pending == 0) 
+  {
+    ctimer_set(&conn->pb_timer, PIGGYBACK_DEADLINE, piggyback_deadline_cb, conn);
+  }
+  conn->pb_pending |= what;
+}
+
+/* Some of the pending messages went out on another frame */
+static void
+piggyback_carried(struct rp_conn *conn, uint8_t what)
+{
+  if (!(conn->pb_pending & what)) return;
+
+  if (conn->pb_pending & what & PB_ADD_CHILD) conn->pb_stats.carried++;
+  if (conn->pb_pending & what & PB_REMOVE_CHILD) conn->pb_stats.carried++;
+  if (conn->pb_pending & what & PB_REPORT) conn->pb_stats.carried++;
+
+  conn->pb_pending &= ~what;
+  if (conn->pb_pending == 0) ctimer_stop(&conn->pb_timer);
+}
+
+/* A unicast to `to` was acked: the parent change our beacons told it is
+   surely known now (the first frame to a new parent is our full report) */
+static void
+piggyback_acked(struct rp_conn *conn, const linkaddr_t *to)
+{
+  if ((conn->pb_pending & PB_ADD_CHILD) && linkaddr_cmp(to, &conn->parent)) 
+  {
+    piggyback_carried(conn, PB_ADD_CHILD);
+  }
+  if ((conn->pb_pending & PB_REMOVE_CHILD) && linkaddr_cmp(to, &conn->pb_old_parent)) 
+  {
+    piggyback_carried(conn, PB_REMOVE_CHILD);
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 /*                              Beacon Handling                              */
 /*---------------------------------------------------------------------------*/
 /* Beacon message structure */
 struct beacon_msg {
+  uint8_t type;
   uint16_t seqn;
   uint16_t metric;
+  uint16_t etx; // path ETX of the sender
 } __attribute__((packed));
 /*---------------------------------------------------------------------------*/
 /* Send beacon using the current seqn and metric */
@@ -101,29 +674,115 @@ send_beacon(struct rp_conn* c)
 {
   /* Prepare the beacon message */
   struct beacon_msg beacon = {
+    .type = RP_MSG_HDR(RP_MSG_BEACON, 0),
     .seqn = c->beacon_seqn, 
-    .metric = c->metric
+    .metric = c->metric,
+    .etx = c->path_etx
   };
 
+  uint8_t args = 0;
+  uint16_t len = sizeof(beacon);
+  uint8_t *buf;
+
+  if (RP_PIGGYBACK && !linkaddr_cmp(&c->parent, &linkaddr_null)) args |= RP_BEACON_PARENT;
+  if (RP_SHORTCUT && !c->is_sink && c->subtree_size > 1) args |= RP_BEACON_SUMMARY;
+  if (RP_CONGESTION && c->congested) args |= RP_BEACON_CONGESTED;
+  beacon.type = RP_MSG_HDR(RP_MSG_BEACON, args);
+
   /* Send the beacon message in broadcast */
   //packetbuf_clear();
   packetbuf_copyfrom(&beacon, sizeof(beacon));
+  buf = (uint8_t *)packetbuf_dataptr();
+  if (args & RP_BEACON_PARENT) 
+  { // followed by our parent: the new (and the old) parent learn our choice,
+    // if they hear it (ADD_CHILD/REMOVE_CHILD stay pending, see piggyback_acked())
+    memcpy(buf + len, &c->parent, sizeof(linkaddr_t));
+    len += sizeof(linkaddr_t);
+  }
+  if (args & RP_BEACON_SUMMARY) 
+  { // and by our subtree: the neighbors may send us what goes to it
+    subtree_summary_fold(c, buf + len);
+    len += SUBTREE_SUMMARY_BYTES;
+  }
+  packetbuf_set_datalen(len);
 
   broadcast_send(&c->bc);
 }
 /*---------------------------------------------------------------------------*/
-/* Beacon timer callback */
-void
-beacon_timer_cb(void* ptr)
+/* Beacon Trickle timer: the beacon_timer fires at t, then at the end of the
+   interval */
+static void trickle_interval_end_cb(void *ptr);
+
+static void
+trickle_new_interval(struct rp_conn *conn)
 {
-  struct rp_conn *c = (struct rp_conn *)ptr;
-  send_beacon(c);
-  if (c->is_sink) 
+  clock_time_t half = conn->trickle_i / 2;
+
+  conn->trickle_c = 0;
+  conn->trickle_t = half + (half > 0 ? random_rand() % half : 0);
+  ctimer_set(&conn->beacon_timer, conn->trickle_t, trickle_fire_cb, conn);
+}
+
+/* At t: send, unless enough neighbors said the same already */
+static void
+trickle_fire_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+
+  if (conn->trickle_c < BEACON_TRICKLE_K) 
   {
-    c->beacon_seqn++; 
-    ctimer_set(&c->beacon_timer, c->current_beacon_interval, beacon_timer_cb, c);
-  } 
+    send_beacon(conn);
+    conn->beacon_stats.sent++;
+  }
+  else conn->beacon_stats.suppressed++;
+
+  // if parent is so stable that it didn't change for a while
+  if (!conn->is_sink && !linkaddr_cmp(&conn->parent, &linkaddr_null) 
+      && clock_time() - conn->last_report_refresh > REPORT_REFRESH_INTERVAL) 
+  {
+    conn->last_report_refresh = clock_time();
+    report_mark_dirty(conn, "stable parent didnt change for a while"); // send a topology report to the parent
+  }
+
+  ctimer_set(&conn->beacon_timer, conn->trickle_i - conn->trickle_t, trickle_interval_end_cb, conn);
+}
+
+static void
+trickle_interval_end_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+
+  conn->trickle_i *= 2;
+  if (conn->trickle_i > BEACON_IMAX) conn->trickle_i = BEACON_IMAX;
+  trickle_new_interval(conn);
+}
+
+/* Inconsistency: back to the shortest interval (and start, the first time) */
+void
+beacon_trickle_reset(struct rp_conn *conn)
+{
+  if (conn->trickle_i == BEACON_IMIN) return;
+
+  if (conn->trickle_i != 0) conn->beacon_stats.resets++;
+  conn->trickle_i = BEACON_IMIN;
+  trickle_new_interval(conn);
+}
+
+static void
+beacon_trickle_start_cb(void *ptr)
+{
+  beacon_trickle_reset((struct rp_conn *)ptr);
+}
+
+/* Sink: a new seqn, the nodes reset their Trickle timers as it spreads */
+static void
+global_repair_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
 
+  conn->beacon_seqn++;
+  beacon_trickle_reset(conn);
+  ctimer_reset(&conn->global_repair_timer);
 }
 /*---------------------------------------------------------------------------*/
 /* Send a remove child message to the parent */
@@ -137,11 +796,24 @@ struct child_msg {
 void send_remove_child(struct unicast_conn *uc, const linkaddr_t *to, const linkaddr_t *child_to_remove) {
   struct child_msg msg;
   memset(&msg, 0, sizeof(msg)); 
-  msg.type = 0xA2; // REMOVE_CHILD -- this type bc with 0x01 i had problem with packets
+  msg.type = RP_MSG_HDR(RP_MSG_CHILD, RP_CHILD_REMOVE);
   //linkaddr_copy(&msg.child, child_to_remove); 
   memcpy(&msg.child, child_to_remove, sizeof(linkaddr_t));
 
-  if (packetbuf_copyfrom(&msg, sizeof(msg)) < sizeof(msg)) {
+  if (packetbuf_copyfrom(&msg, sizeof(msg)) < (int)sizeof(msg)) {
+    return;
+  }
+  unicast_send(uc, to);
+}
+
+/* Ask a child for a full topology report (its delta did not apply) */
+void send_report_resync(struct unicast_conn *uc, const linkaddr_t *to) {
+  struct child_msg msg;
+  memset(&msg, 0, sizeof(msg)); 
+  msg.type = RP_MSG_HDR(RP_MSG_CHILD, RP_CHILD_RESYNC);
+  memcpy(&msg.child, to, sizeof(linkaddr_t));
+
+  if (packetbuf_copyfrom(&msg, sizeof(msg)) < (int)sizeof(msg)) {
     return;
   }
   unicast_send(uc, to);
@@ -151,165 +823,752 @@ void send_remove_child(struct unicast_conn *uc, const linkaddr_t *to, const link
 void send_add_child(struct unicast_conn *uc, const linkaddr_t *to) {
   struct child_msg msg;
   memset(&msg, 0, sizeof(msg)); 
-  msg.type = 0xA1; // ADD_CHILD
+  msg.type = RP_MSG_HDR(RP_MSG_CHILD, RP_CHILD_ADD);
   //linkaddr_copy(&msg.child, &linkaddr_node_addr);
   memcpy(&msg.child, &linkaddr_node_addr, sizeof(linkaddr_t));
 
-  if (packetbuf_copyfrom(&msg, sizeof(msg)) < sizeof(msg)) {
+  if (packetbuf_copyfrom(&msg, sizeof(msg)) < (int)sizeof(msg)) {
     return;
   }
   unicast_send(uc, to);
 }
 
 /*---------------------------------------------------------------------------*/
-/* Check if a node is in the subtree - for the parent changing*/
+/* Check if a node is in the subtree - for the parent changing. The summary
+   only: a false positive rejects one candidate parent, a loop is worse */
 bool is_in_subtree(struct rp_conn* conn, const linkaddr_t *node) {
-  uint16_t i;
-  for (i = 0; i < conn->subtree_size; i++) {
-    if (linkaddr_cmp(node, &conn->subtree[i])) {
-      return true;
+  return summary_has(conn->subtree_summary, SUBTREE_FILTER_BYTES, node);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Leave the parent: it learns it from a REMOVE_CHILD, or from our beacon */
+static void
+parent_drop(struct rp_conn *conn)
+{
+  if (RP_PIGGYBACK) 
+  { // the old parent learns it from our next beacons, or at the deadline
+    if (conn->pb_pending & PB_REMOVE_CHILD) 
+    { // still one for a previous parent
+      send_remove_child(&conn->uc, &conn->pb_old_parent, &linkaddr_node_addr);
+      conn->pb_stats.standalone++;
     }
+    linkaddr_copy(&conn->pb_old_parent, &conn->parent);
+    piggyback_defer(conn, PB_REMOVE_CHILD);
   }
-  return false;
+  else send_remove_child(&conn->uc, &conn->parent, &linkaddr_node_addr); // send remove child message to the old parent
+  delete_route(&conn->parent, &conn->parent); // delete the old parent route from RT
+}
+
+/* Take new_parent as the parent, at hop metric and path ETX */
+static void
+parent_switch(struct rp_conn *conn, const linkaddr_t *new_parent, uint16_t metric, uint16_t path_etx, int16_t rssi)
+{
+  if ((conn->pb_pending & PB_REMOVE_CHILD) && linkaddr_cmp(new_parent, &conn->pb_old_parent)) 
+  { // back to the parent we were leaving: nothing to remove there
+    conn->pb_pending &= ~PB_REMOVE_CHILD;
+  }
+  if(!linkaddr_cmp(&conn->parent, &linkaddr_null)) parent_drop(conn);
+
+  /* Memorize the new parent and the metric */
+  linkaddr_copy(&conn->parent, new_parent);
+  // a route down through the parent is a loop: it was our child once, or
+  // sent us its data (reverse path) before the ranks changed
+  delete_route_by_next_hop(conn, new_parent, false);
+
+  // to keep for a while one parent
+  conn->last_parent_change = clock_time();
+  conn->last_report_refresh = clock_time();
+
+  conn->metric = metric;
+  conn->path_etx = path_etx;
+  conn->rssi = rssi;
+
+  add_route(conn, new_parent, new_parent, ROUTE_PARENT, metric, rssi); // add new parent route to the RT
+
+  if (RP_PIGGYBACK) piggyback_defer(conn, PB_ADD_CHILD); // in the beacon we send now
+  else send_add_child(&conn->uc, new_parent); // send a message to the new parent to add this node as a child
+
+  report_send_now(conn, "new parent"); // the new parent has nothing from us yet
+}
+
+/* The parent stopped acking: the best neighbor route closer to the sink than
+   we were takes over, the frames queued for the old parent go to it */
+static void
+parent_failover(struct rp_conn *conn)
+{
+  linkaddr_t old_parent;
+  neighbor_entry_t *best = NULL;
+  routing_entry_t *route = NULL;
+  uint8_t i;
+
+  for (i = 0; i < neighbors_used; i++) 
+  {
+    neighbor_entry_t *n = &neighbors[i];
+    routing_entry_t *r = lookup_route(&n->addr, true);
+
+    if (r == NULL || r->type != ROUTE_NEIGHBOR || n->tx_fails >= PARENT_FAIL_THRESHOLD 
+        || n->path_etx >= conn->path_etx || is_in_subtree(conn, &n->addr)) continue;
+    if (best == NULL || neighbor_parent_cost(n) < neighbor_parent_cost(best)) 
+    {
+      best = n;
+      route = r;
+    }
+  }
+
+  printf("rp: parent %02x:%02x not acking, failover to %02x:%02x\n",
+         conn->parent.u8[0], conn->parent.u8[1],
+         best ? best->addr.u8[0] : 0, best ? best->addr.u8[1] : 0);
+  conn->nbr_stats.failovers++;
+  linkaddr_copy(&old_parent, &conn->parent);
+
+  if (best != NULL) 
+  {
+    parent_switch(conn, &best->addr, route->metric, neighbor_path_etx(best), best->rssi);
+    forward_retarget(conn, &old_parent, &best->addr);
+  }
+  else 
+  { // nobody to go to: wait for a beacon without a parent
+    parent_drop(conn);
+    linkaddr_copy(&conn->parent, &linkaddr_null);
+    conn->metric = 65535;
+    conn->path_etx = ETX_INFINITE;
+  }
+  beacon_trickle_reset(conn);
 }
 
 /*---------------------------------------------------------------------------*/
-/* Beacon receive callback */
-void
-bc_recv(struct broadcast_conn *bc_conn, const linkaddr_t *sender)
+/* Node receives a beacon */
+static void
+beacon_recv(struct rp_conn *conn, const linkaddr_t *sender, uint8_t args)
 {
   struct beacon_msg beacon;
   int16_t rssi;
 
-  /* Get the pointer to the overall structure rp_conn from its field bc */
-  struct rp_conn* conn = (struct rp_conn*)(((uint8_t*)bc_conn) - offsetof(struct rp_conn, bc));
-
   /* ------------------------------------------------------- */
   /* Check if the received broadcast packet looks legitimate */
-  if (packetbuf_datalen() != sizeof(struct beacon_msg))
+  uint16_t len = sizeof(struct beacon_msg) + ((args & RP_BEACON_PARENT) ? sizeof(linkaddr_t) : 0)
+                 + ((args & RP_BEACON_SUMMARY) ? SUBTREE_SUMMARY_BYTES : 0);
+  if (packetbuf_datalen() != len)
   {
     return;
   }
 
   memcpy(&beacon, packetbuf_dataptr(), sizeof(struct beacon_msg));
-  bool parent_set = false;
-  bool should_forward = false;
+
+  if (args & RP_BEACON_PARENT) 
+  {
+    linkaddr_t their_parent;
+    memcpy(&their_parent, (uint8_t *)packetbuf_dataptr() + sizeof(struct beacon_msg), sizeof(linkaddr_t));
+    beacon_parent_recv(conn, sender, &their_parent);
+  }
+  bool consistent = true; // nothing new for us in this beacon
+  neighbor_entry_t *nbr, *parent;
+  uint16_t path_etx;
+  uint32_t parent_cost;
 
   /* ------------------------------------------------------- */
   /*                    evaluate a beacon                    */
   /* ------------------------------------------------------- */
   rssi = packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  if (rssi < RSSI_THRESHOLD || beacon.seqn < conn->beacon_seqn)
+  nbr = neighbor_beacon(conn, sender, rssi, packetbuf_attr(PACKETBUF_ATTR_LINK_QUALITY), beacon.etx);
+  nbr->metric = beacon.metric > 0xFF ? 0xFF : beacon.metric;
+  neighbor_congestion(conn, sender, (args & RP_BEACON_CONGESTED) != 0);
+  if (args & RP_BEACON_SUMMARY) memcpy(nbr->summary, (uint8_t *)packetbuf_dataptr() + len - SUBTREE_SUMMARY_BYTES, SUBTREE_SUMMARY_BYTES);
+  else memset(nbr->summary, 0, SUBTREE_SUMMARY_BYTES);
+  if (nbr->rssi < RSSI_THRESHOLD || BEACON_SEQN_NEWER(conn->beacon_seqn, beacon.seqn))
   { 
-    return; // The beacon is either too weak or too old, ignore it
+    return; // The link is either too weak or the beacon too old, ignore it
+  }
+  if (BEACON_SEQN_NEWER(beacon.seqn, conn->beacon_seqn)) consistent = false; // a new round
+  if (beacon.etx == ETX_INFINITE && conn->path_etx != ETX_INFINITE) consistent = false; // lost its parent, answer soon
+  path_etx = neighbor_path_etx(nbr);
+
+  /* ------------------------------------------------------- */
+  /*   follow the seqn, the metric and the ETX of the parent  */
+  /* ------------------------------------------------------- */
+  if ( !conn->is_sink && linkaddr_cmp(sender, &conn->parent) 
+       && (beacon.seqn != conn->beacon_seqn || beacon.metric + 1 != conn->metric 
+           || path_etx_moved(conn->path_etx, path_etx)) ) 
+  {
+    conn->beacon_seqn = beacon.seqn;
+    conn->metric = beacon.metric + 1;
+    conn->path_etx = path_etx;
+    add_route(conn, sender, sender, ROUTE_PARENT, conn->metric, rssi);
+    consistent = false;
   }
   
   /* ------------------------------------------------------- */
-  /*                    evaluate as a parent                 */
+  /*   evaluate as a parent: a better path ETX, by a margin   */
+  /*   (a congested neighbor, the parent too, costs more)     */
   /* ------------------------------------------------------- */
-  if ( !conn->is_sink && beacon.seqn == conn->beacon_seqn ) 
+  parent = neighbor_lookup(&conn->parent);
+  parent_cost = conn->path_etx + (parent != NULL && parent->congested ? CONGESTION_ETX_PENALTY : 0);
+  if ( !conn->is_sink && path_etx != ETX_INFINITE 
+       && neighbor_parent_cost(nbr) + PARENT_SWITCH_THRESHOLD < parent_cost ) 
   {
-    if ( beacon.metric + 1 <= conn->metric )
+    if (!linkaddr_cmp(&conn->parent, sender) && !is_in_subtree(conn, sender) 
+        && ( (clock_time() - conn->last_parent_change) > MIN_PARENT_SWITCH_INTERVAL || conn->last_parent_change == 0 
+             || linkaddr_cmp(&conn->parent, &linkaddr_null) ) ) 
     {
-      if (!linkaddr_cmp(&conn->parent, sender) && !is_in_subtree(conn, sender) 
-              && ( (clock_time() - conn->last_parent_change) > MIN_PARENT_SWITCH_INTERVAL || conn->last_parent_change == 0 ) ) 
-      {
-        if(!linkaddr_cmp(&conn->parent, &linkaddr_null)) 
-        {
-          send_remove_child(&conn->uc, &conn->parent, &linkaddr_node_addr); // send remove child message to the old parent
-          delete_route(&conn->parent, &conn->parent); // delete the old parent route from RT
-        }
+      if (parent != NULL && parent->congested) conn->cong_stats.avoided++;
+      conn->beacon_seqn = beacon.seqn;
+      parent_switch(conn, sender, beacon.metric + 1, path_etx, rssi);
+      consistent = false; // advertise the new parent and metric soon
+    }
+  }
+  /* ------------------------------------------------------- */
+  /*                     add as a neigbor                    */
+  /* ------------------------------------------------------- */
+  if(!linkaddr_cmp(sender, &conn->parent))
+  { // add the neighbor route to the routing table if its not parent
+    add_route(conn, sender, sender, ROUTE_NEIGHBOR, beacon.metric + 1, rssi); 
+  }
+  /* ------------------------------------------------------- */
+  /* Trickle: count what we heard, or start over. Only beacons from our depth 
+     or deeper cover the nodes that would hear ours */
+  if (!consistent) beacon_trickle_reset(conn);
+  else if (beacon.metric >= conn->metric) conn->trickle_c++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                               Data Handling                               */
+/*---------------------------------------------------------------------------*/
+/* Header of data packets, as it is on air:
+     RP_MSG_HDR(RP_MSG_DATA, hops | RP_DATA_SHORT_ADDR?), seqn, rank, source, dest
+   with source and dest one byte each in the short form. The seqn counts the
+   packets of the source, (source, seqn) is what the duplicate cache keeps.
+   The rank byte is the one of the last hop, data_stamp() writes it. */
+struct collect_header {
+  linkaddr_t source;
+  linkaddr_t dest;
+  uint8_t hops;
+  uint8_t seqn;
+  uint8_t rank;
+};
+#define COLLECT_HDR_RANK 2 // offset of the rank byte
+#define COLLECT_HDR_MIN_LEN 5
+#define COLLECT_HDR_MAX_LEN (3 + 2 * sizeof(linkaddr_t))
 
-        /* Memorize the new parent, the metric, and the seqn */
-        linkaddr_copy(&conn->parent, sender);
+static uint8_t
+collect_header_len(uint8_t args)
+{
+  return (args & RP_DATA_SHORT_ADDR) ? COLLECT_HDR_MIN_LEN : COLLECT_HDR_MAX_LEN;
+}
 
-        // to keep for a while one parent
-        conn->last_parent_change = clock_time();
+/* Write the header to buf, return its length */
+static uint8_t
+collect_header_write(uint8_t *buf, const struct collect_header *hdr)
+{
+  uint8_t args = hdr->hops & RP_DATA_HOPS_MASK;
+
+  if (hdr->source.u8[1] == 0 && hdr->dest.u8[1] == 0) 
+  {
+    args |= RP_DATA_SHORT_ADDR;
+    buf[3] = hdr->source.u8[0];
+    buf[4] = hdr->dest.u8[0];
+  } 
+  else 
+  {
+    memcpy(&buf[3], &hdr->source, sizeof(linkaddr_t));
+    memcpy(&buf[3 + sizeof(linkaddr_t)], &hdr->dest, sizeof(linkaddr_t));
+  }
+  buf[0] = RP_MSG_HDR(RP_MSG_DATA, args);
+  buf[1] = hdr->seqn;
+  buf[COLLECT_HDR_RANK] = hdr->rank;
+  return collect_header_len(args);
+}
+
+/* Read the header of the packet in buf, return its length (0: too short) */
+static uint8_t
+collect_header_read(const uint8_t *buf, uint16_t len, struct collect_header *hdr)
+{
+  uint8_t args = RP_MSG_ARGS(buf[0]);
+  uint8_t hdr_len = collect_header_len(args);
+
+  if (len < hdr_len) return 0;
+
+  memset(hdr, 0, sizeof(*hdr));
+  if (args & RP_DATA_SHORT_ADDR) 
+  {
+    hdr->source.u8[0] = buf[3];
+    hdr->dest.u8[0] = buf[4];
+  } 
+  else 
+  {
+    memcpy(&hdr->source, &buf[3], sizeof(linkaddr_t));
+    memcpy(&hdr->dest, &buf[3 + sizeof(linkaddr_t)], sizeof(linkaddr_t));
+  }
+  hdr->hops = args & RP_DATA_HOPS_MASK;
+  hdr->seqn = buf[1];
+  hdr->rank = buf[COLLECT_HDR_RANK];
+  return hdr_len;
+}
+
+/* Our rank, and whether it goes down, in the data frame in the packetbuf:
+   done when it goes, the next hop may have changed while it was queued.
+   Returns whether it was stamped down. */
+static bool
+data_stamp(struct rp_conn *conn, const linkaddr_t *next_hop)
+{
+  uint8_t *buf = packetbuf_dataptr();
+  uint8_t rank = conn->metric < RP_DATA_RANK_INFINITE ? conn->metric : RP_DATA_RANK_INFINITE;
+
+  if (RP_MSG_TYPE(buf[0]) != RP_MSG_DATA) return false;
+  if (!linkaddr_cmp(next_hop, &conn->parent)) rank |= RP_DATA_DOWN;
+  if (conn->congested) rank |= RP_DATA_CONGESTED;
+  buf[COLLECT_HDR_RANK] = (buf[COLLECT_HDR_RANK] & RP_DATA_RANK_ERR) | rank;
+  return (rank & RP_DATA_DOWN) != 0;
+}
+
+/* No route for the data frame in the packetbuf: flood it */
+static int
+flood_start(struct rp_conn *conn)
+{
+  uint8_t *buf = packetbuf_dataptr();
+
+  buf[COLLECT_HDR_RANK] = (buf[COLLECT_HDR_RANK] & RP_DATA_RANK_ERR) | RP_DATA_DOWN
+                          | (conn->metric < RP_DATA_RANK_INFINITE ? conn->metric : RP_DATA_RANK_INFINITE);
+  if (!packetbuf_hdralloc(1)) return -2;
+  *(uint8_t *)packetbuf_hdrptr() = RP_MSG_HDR(RP_MSG_FLOOD, FLOOD_TTL);
+  broadcast_send(&conn->bc);
+  conn->flood_stats.started++;
+  return 1;
+}
+
+/* Where a frame to dest goes: route->next_hop, or a neighbor with dest in
+   its subtree summary if the route is only the parent fallback. Not back
+   to `from`, where the frame came from (NULL for ours). The neighbor is not
+   shallower than us: the hop is stamped down, and data_rank_check() there
+   would take a shallower one for a loop. */
+static const linkaddr_t *
+data_next_hop(struct rp_conn *conn, const linkaddr_t *dest, const linkaddr_t *from, const routing_entry_t *route)
+{
+  neighbor_entry_t *best = NULL;
+  uint8_t i;
+
+  if (!RP_SHORTCUT || route->type != ROUTE_PARENT || linkaddr_cmp(&route->destination, dest)) return &route->next_hop;
+
+  for (i = 0; i < neighbors_used; i++) 
+  {
+    neighbor_entry_t *n = &neighbors[i];
+
+    if (n->metric < conn->metric || n->tx_fails >= PARENT_FAIL_THRESHOLD || linkaddr_cmp(&n->addr, &conn->parent)
+        || (from != NULL && linkaddr_cmp(&n->addr, from)) || !summary_has(n->summary, SUBTREE_SUMMARY_BYTES, dest)
+        || lookup_route(&n->addr, true) == NULL) continue; // not heard for a while
+    if (best == NULL || n->metric < best->metric || (n->metric == best->metric && n->etx < best->etx)) best = n;
+  }
+  if (best == NULL) return &route->next_hop;
+
+  conn->fwd_stats.shortcuts++;
+  return &best->addr;
+}
+/*---------------------------------------------------------------------------*/
+/* Forwarding queue. fwd_busy: the head is in the MAC, or waits for a retry */
+static void forward_retry_cb(void *ptr);
+static void forward_sent_timeout_cb(void *ptr);
+
+/* Congested or not, from the queue and the frames not sent, with some
+   hysteresis. The neighbors hear it at once in a beacon when it starts. */
+static void
+congestion_update(struct rp_conn *conn)
+{
+  bool congested = conn->congested;
 
-        // dynamic beacon interval
-        conn->current_beacon_interval = BEACON_MIN_INTERVAL;  
-        conn->last_beacon_forward = clock_time();
-        conn->parent_stable_counter = 0;
+  if (!RP_CONGESTION) return;
+  if (conn->fwd_len >= CONGESTION_QUEUE || conn->tx_fail_rate > CONGESTION_FAIL_RATE) congested = true;
+  else if (conn->fwd_len <= 1 && conn->tx_fail_rate <= CONGESTION_FAIL_RATE / 2) congested = false;
+  if (congested == conn->congested) return;
 
-        conn->metric = beacon.metric + 1;
-        conn->beacon_seqn = beacon.seqn;
-        conn->rssi = rssi;
+  conn->congested = congested;
+  if (congested) 
+  {
+    conn->cong_stats.onsets++;
+    beacon_trickle_reset(conn);
+  }
+}
 
-        should_forward = true;
+/* Outcome of a frame of ours or forwarded, for the fail rate */
+static void
+congestion_tx(struct rp_conn *conn, bool sent)
+{
+  conn->tx_fail_rate = (uint16_t)ewma(conn->tx_fail_rate, sent ? 0 : 256, CONGESTION_FAIL_ALPHA);
+  congestion_update(conn);
+}
 
-        add_route(conn, sender, sender, ROUTE_PARENT, beacon.metric + 1, rssi); // add new parent route to the RT
+/* We, or the next hop, are congested */
+static bool
+congestion_ahead(struct rp_conn *conn, const linkaddr_t *next_hop)
+{
+  neighbor_entry_t *n = neighbor_lookup(next_hop);
+  return RP_CONGESTION && (conn->congested || (n != NULL && n->congested));
+}
 
-        if (!linkaddr_cmp(&conn->parent, &linkaddr_null)) {
-          send_add_child(&conn->uc, sender); // send a message to the new parent to add this node as a child
-        }
+static void
+forward_pop(struct rp_conn *conn)
+{
+  queuebuf_free(conn->fwd_queue[conn->fwd_head].qb);
+  conn->fwd_head = (conn->fwd_head + 1) % FORWARD_QUEUE_LEN;
+  conn->fwd_len--;
+  congestion_update(conn);
+}
 
-        send_topology_report(conn, "new parent"); // send a topology report to the new parent
-        parent_set = true;
+static void
+forward_next(struct rp_conn *conn)
+{
+  struct forward_entry *e;
 
+  while (conn->fwd_len > 0) 
+  {
+    e = &conn->fwd_queue[conn->fwd_head];
+    queuebuf_to_packetbuf(e->qb);
+    e->down = data_stamp(conn, &e->next_hop);
+    piggyback_attach(conn, &e->next_hop); // the report rides on what goes now
+    conn->fwd_busy = true;
+    linkaddr_copy(&conn->fwd_to, &e->next_hop); // before: the callback may come at once
+    conn->fwd_seqno_known = false;
+    ctimer_set(&conn->fwd_sent_timer, FORWARD_SENT_TIMEOUT, forward_sent_timeout_cb, conn);
+    if (unicast_send(&conn->uc, &e->next_hop)) 
+    {
+      if (!linkaddr_cmp(&conn->fwd_to, &linkaddr_null) && !conn->fwd_seqno_known) 
+      { // still in the MAC, and not a frame a callback in there sent after it
+        conn->fwd_seqno = packetbuf_attr(PACKETBUF_ATTR_MAC_SEQNO);
+        conn->fwd_seqno_known = true;
       }
-      else 
-      {
-        conn->parent_stable_counter++;
-
-        if (conn->parent_stable_counter >= STABILITY_THRESHOLD) 
-        {
-          conn->current_beacon_interval *= 2;
-          if (conn->current_beacon_interval > BEACON_MAX_INTERVAL) conn->current_beacon_interval = BEACON_MAX_INTERVAL;
-          conn->parent_stable_counter = 0;
-        }
-        parent_set = true;
-        
-        // if parent is so stable that it didn't change for a while
-        if (clock_time() - conn->last_beacon_forward > BEACON_SILENT_LIMIT) 
-        {
-          should_forward = true;
-          conn->last_beacon_forward = clock_time();
-
-          send_topology_report(conn, "stable parent didnt change for a while"); // send a topology report to the parent
-
-        }
+      return;
+    }
+    ctimer_stop(&conn->fwd_sent_timer);
+    linkaddr_copy(&conn->fwd_to, &linkaddr_null);
+
+    if (e->retries++ < FORWARD_MAX_RETRIES) 
+    {
+      ctimer_set(&conn->fwd_retry_timer, FORWARD_RETRY_DELAY, forward_retry_cb, conn);
+      return;
+    }
+    conn->fwd_busy = false;
+    conn->fwd_stats.tx_failed++;
+    congestion_tx(conn, false);
+    forward_pop(conn);
+  }
+}
+
+static void
+forward_retry_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+  conn->fwd_busy = false;
+  forward_next(conn);
+}
+
+/* The MAC never called back for the head: as if it could not send it */
+static void
+forward_sent_timeout_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+
+  if (!conn->fwd_busy || linkaddr_cmp(&conn->fwd_to, &linkaddr_null)) return;
+  printf("forward: no sent callback from the MAC, given up\n");
+  forward_sent(conn, MAC_TX_ERR);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Local repair of the routes down */
+struct route_query {
+  uint8_t type;
+  linkaddr_t dest;
+  linkaddr_t avoid; // query: answer only with another next hop than this
+  uint8_t metric;   // reply: hops from the replier to dest
+} __attribute__((packed));
+
+typedef enum {
+  REPAIR_NONE,    // the frame is lost
+  REPAIR_RESEND,  // the head goes again, to its new next hop
+  REPAIR_PENDING  // the frame waits in repair_qb for an answer
+} repair_result_t;
+
+static int forward_enqueue(struct rp_conn *conn, const linkaddr_t *next_hop);
+static bool dup_cache_seen(struct rp_conn *conn, const linkaddr_t *source, uint8_t seqn);
+
+static void
+repair_timeout_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+
+  printf("repair: no route to %02x:%02x\n", conn->repair_dest.u8[0], conn->repair_dest.u8[1]);
+  queuebuf_free(conn->repair_qb);
+  conn->repair_qb = NULL;
+  conn->repair_stats.failed++;
+}
+
+/* The head of the queue was not acked by its next hop, on the way down */
+static repair_result_t
+route_repair(struct rp_conn *conn, struct forward_entry *e)
+{
+  struct collect_header hdr;
+  struct route_query q;
+  neighbor_entry_t *n;
+
+  queuebuf_to_packetbuf(e->qb);
+  if (RP_MSG_TYPE(*(uint8_t *)packetbuf_dataptr()) != RP_MSG_DATA 
+      || collect_header_read(packetbuf_dataptr(), packetbuf_datalen(), &hdr) == 0) return REPAIR_NONE;
+
+  // the destination is one of our neighbors: straight to it
+  n = neighbor_lookup(&hdr.dest);
+  if (n != NULL && !linkaddr_cmp(&hdr.dest, &e->next_hop) && n->tx_fails < PARENT_FAIL_THRESHOLD) 
+  {
+    patch_route(conn, &hdr.dest, &hdr.dest, 1, n->rssi);
+    linkaddr_copy(&e->next_hop, &hdr.dest);
+    e->retries = 0;
+    conn->repair_stats.direct++;
+    return REPAIR_RESEND;
+  }
+
+  if (conn->repair_qb != NULL) 
+  {
+    conn->repair_stats.failed++;
+    return REPAIR_NONE;
+  }
+
+  // ask the neighbors
+  conn->repair_qb = e->qb;
+  linkaddr_copy(&conn->repair_dest, &hdr.dest);
+  linkaddr_copy(&conn->repair_avoid, &e->next_hop);
+  ctimer_set(&conn->repair_timer, ROUTE_REPAIR_TIMEOUT, repair_timeout_cb, conn);
+
+  memset(&q, 0, sizeof(q));
+  q.type = RP_MSG_HDR(RP_MSG_QUERY, 0);
+  memcpy(&q.dest, &hdr.dest, sizeof(linkaddr_t));
+  memcpy(&q.avoid, &e->next_hop, sizeof(linkaddr_t));
+  packetbuf_copyfrom(&q, sizeof(q));
+  broadcast_send(&conn->bc);
+  conn->repair_stats.queried++;
+  return REPAIR_PENDING;
+}
+
+/* A route query (broadcast) or the answer to ours (unicast) */
+static void
+query_recv(struct rp_conn *conn, const linkaddr_t *from, uint8_t args)
+{
+  struct route_query q;
+  routing_entry_t *route;
+  linkaddr_t dest, avoid;
+
+  memcpy(&q, packetbuf_dataptr(), sizeof(q));
+  memcpy(&dest, &q.dest, sizeof(linkaddr_t));
+  memcpy(&avoid, &q.avoid, sizeof(linkaddr_t));
+
+  if (args & RP_QUERY_ERROR) 
+  { // our route to dest goes to `from`, and its own back to us
+    route = lookup_route(&dest, true);
+    if (route != NULL && (route->type == ROUTE_TOPOLOGY || route->type == ROUTE_REVERSE) 
+        && linkaddr_cmp(&route->next_hop, from)) 
+    {
+      printf("query_recv: route error for %02x:%02x from %02x:%02x\n", dest.u8[0], dest.u8[1], from->u8[0], from->u8[1]);
+      remove_from_subtree(conn, &dest);
+      delete_route(&dest, from);
+    }
+    return;
+  }
+
+  if (args & RP_QUERY_REPLY) 
+  {
+    if (conn->repair_qb == NULL || !linkaddr_cmp(&dest, &conn->repair_dest)) return; // late
+    ctimer_stop(&conn->repair_timer);
+    patch_route(conn, &dest, from, q.metric + 1, packetbuf_attr(PACKETBUF_ATTR_RSSI));
+
+    queuebuf_to_packetbuf(conn->repair_qb);
+    queuebuf_free(conn->repair_qb);
+    conn->repair_qb = NULL;
+    forward_enqueue(conn, from);
+    conn->repair_stats.repaired++;
+    return;
+  }
+
+  // answer only with a route of our own, that doesn't go back or to the broken hop
+  route = lookup_route(&dest, true);
+  if (route == NULL || linkaddr_cmp(&route->next_hop, from) || linkaddr_cmp(&route->next_hop, &avoid)) return;
+
+  q.type = RP_MSG_HDR(RP_MSG_QUERY, RP_QUERY_REPLY);
+  q.metric = route->metric > 0xFF ? 0xFF : route->metric;
+  packetbuf_copyfrom(&q, sizeof(q));
+  unicast_send(&conn->uc, from);
+}
+
+/* Route error to `to`: its route to dest comes through us and goes back */
+static void
+send_route_error(struct rp_conn *conn, const linkaddr_t *to, const linkaddr_t *dest)
+{
+  struct route_query q;
+
+  memset(&q, 0, sizeof(q));
+  q.type = RP_MSG_HDR(RP_MSG_QUERY, RP_QUERY_ERROR);
+  memcpy(&q.dest, dest, sizeof(linkaddr_t));
+  packetbuf_copyfrom(&q, sizeof(q));
+  unicast_send(&conn->uc, to);
+  conn->loop_stats.route_errors++;
+}
+
+/*---------------------------------------------------------------------------*/
+/* The MAC is done with the frame in flight */
+static void
+forward_sent(struct rp_conn *conn, int status)
+{
+  struct forward_entry *e = &conn->fwd_queue[conn->fwd_head];
+  repair_result_t repair = REPAIR_NONE;
+  linkaddr_t sent_to;
+
+  ctimer_stop(&conn->fwd_sent_timer);
+  linkaddr_copy(&sent_to, &conn->fwd_to);
+  linkaddr_copy(&conn->fwd_to, &linkaddr_null);
+  conn->fwd_seqno_known = false;
+
+  if (status != MAC_TX_OK && !linkaddr_cmp(&e->next_hop, &sent_to)) 
+  { // retargeted while in flight (a parent failover): on to the new next hop
+    conn->fwd_busy = false;
+    forward_next(conn);
+    return;
+  }
+
+  if ((status == MAC_TX_COLLISION || status == MAC_TX_ERR || status == MAC_TX_DEFERRED) 
+      && e->retries++ < FORWARD_MAX_RETRIES) 
+  { // the MAC had no room or no channel for it, try again
+    ctimer_set(&conn->fwd_retry_timer, FORWARD_RETRY_DELAY, forward_retry_cb, conn);
+    return;
+  }
+
+  if (status == MAC_TX_OK) conn->fwd_stats.sent++;
+  else if (status == MAC_TX_NOACK && e->down && !linkaddr_cmp(&e->next_hop, &linkaddr_node_addr)) 
+  { // on the way down: look for another way
+    repair = route_repair(conn, e);
+  }
+  if (status != MAC_TX_OK && repair == REPAIR_NONE) conn->fwd_stats.tx_failed++;
+  if (repair == REPAIR_NONE) congestion_tx(conn, status == MAC_TX_OK);
+
+  conn->fwd_busy = false;
+  if (repair == REPAIR_PENDING) 
+  { // the queuebuf went to repair_qb
+    conn->fwd_head = (conn->fwd_head + 1) % FORWARD_QUEUE_LEN;
+    conn->fwd_len--;
+  }
+  else if (repair == REPAIR_NONE) forward_pop(conn);
+  forward_next(conn);
+}
+
+/* Frames for the next hop `from` go to `to`. The head too: if it is in
+   flight and not acked, forward_sent() sends it again to `to`. */
+static void
+forward_retarget(struct rp_conn *conn, const linkaddr_t *from, const linkaddr_t *to)
+{
+  uint8_t i;
+  for (i = 0; i < conn->fwd_len; i++) 
+  {
+    struct forward_entry *e = &conn->fwd_queue[(conn->fwd_head + i) % FORWARD_QUEUE_LEN];
+    if (linkaddr_cmp(&e->next_hop, from)) linkaddr_copy(&e->next_hop, to);
+  }
+}
+
+/* Queue the data frame in the packetbuf for next_hop, 0 if there is no room */
+static int
+forward_enqueue(struct rp_conn *conn, const linkaddr_t *next_hop)
+{
+  struct forward_entry *e;
+  struct queuebuf *qb;
+
+  if (conn->fwd_len == FORWARD_QUEUE_LEN || (qb = queuebuf_new_from_packetbuf()) == NULL) 
+  {
+    printf("forward: queue full, drop\n");
+    conn->fwd_stats.drops++;
+    congestion_tx(conn, false);
+    return 0;
+  }
+
+  e = &conn->fwd_queue[(conn->fwd_head + conn->fwd_len) % FORWARD_QUEUE_LEN];
+  e->qb = qb;
+  linkaddr_copy(&e->next_hop, next_hop);
+  e->retries = 0;
+  e->down = false;
+  conn->fwd_len++;
+  if (conn->fwd_len > conn->fwd_stats.high_water) conn->fwd_stats.high_water = conn->fwd_len;
+  congestion_update(conn);
+
+  if (!conn->fwd_busy) forward_next(conn);
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Non-storing mode, at the sink: the way down to dest, from the parents the
+   nodes reported. path[0] is the first hop, a neighbor of ours, path[n-1] is
+   dest. Returns n, 0 if a parent is missing or the parents loop. */
+static uint8_t
+source_route_build(const linkaddr_t *dest, linkaddr_t *path)
+{
+  linkaddr_t node;
+  routing_entry_t *e;
+  uint8_t n = 0, i;
+
+  linkaddr_copy(&node, dest);
+  while (n < MAX_PATH_LENGTH) 
+  {
+    e = lookup_route(&node, true);
+    if (e == NULL || e->type == ROUTE_SELF) return 0;
+    linkaddr_copy(&path[n++], &node);
+
+    if (e->type != ROUTE_SOURCE) 
+    { // a neighbor, or a child that joined us
+      if (!linkaddr_cmp(&e->next_hop, &node)) return 0;
+      break;
+    }
+    if (linkaddr_cmp(&e->next_hop, &linkaddr_node_addr)) break; // our child
+    linkaddr_copy(&node, &e->next_hop);
+  }
+  if (n == MAX_PATH_LENGTH && e->type == ROUTE_SOURCE && !linkaddr_cmp(&e->next_hop, &linkaddr_node_addr)) return 0;
+
+  // it was built from dest up
+  for (i = 0; i < n / 2; i++) 
+  {
+    linkaddr_copy(&node, &path[i]);
+    linkaddr_copy(&path[i], &path[n - 1 - i]);
+    linkaddr_copy(&path[n - 1 - i], &node);
+  }
+  return n;
+}
 
-      }
+/* Queue the data frame in packetbuf on a source route to dest, 0 if there is
+   none or no room */
+static int
+source_route_send(struct rp_conn *conn, const linkaddr_t *dest)
+{
+  linkaddr_t path[MAX_PATH_LENGTH];
+  uint8_t n = source_route_build(dest, path);
+  uint8_t args, len, i;
+  uint8_t *hdr;
 
-    }
-  }
-  /* ------------------------------------------------------- */
-  /*                     add as a neigbor                    */
-  /* ------------------------------------------------------- */
-  if(!parent_set)
-  { // add the neighbor route to the routing table if its not parent
-    add_route(conn, sender, sender, ROUTE_NEIGHBOR, beacon.metric + 1, rssi); 
+  if (n == 0) 
+  {
+    printf("source_route: no route to %02x:%02x\n", dest->u8[0], dest->u8[1]);
+    conn->ns_stats.no_route++;
+    return 0;
   }
-  /* ------------------------------------------------------- */
-  /* Schedule beacon propagation */
-  ctimer_stop(&conn->beacon_timer);
-  if (!conn->is_sink) 
+
+  // the first hop is where it goes, the others in the header
+  args = (n - 1) | RP_SOURCE_SHORT_ADDR;
+  for (i = 1; i < n; i++) 
   {
-    if (should_forward) 
-    {
-      ctimer_set(&conn->beacon_timer, BEACON_FORWARD_DELAY, beacon_timer_cb, conn);
-    } 
-    else 
-    {
-      ctimer_set(&conn->beacon_timer, conn->current_beacon_interval, beacon_timer_cb, conn);
-    }
+    if (path[i].u8[1] != 0) args &= ~RP_SOURCE_SHORT_ADDR;
+  }
+  len = 1 + (n - 1) * ((args & RP_SOURCE_SHORT_ADDR) ? 1 : sizeof(linkaddr_t));
+  if (!packetbuf_hdralloc(len)) return 0;
 
-  } 
-  else 
+  hdr = packetbuf_hdrptr();
+  hdr[0] = RP_MSG_HDR(RP_MSG_SOURCE, args);
+  for (i = 1; i < n; i++) 
   {
-    ctimer_set(&conn->beacon_timer, conn->current_beacon_interval, beacon_timer_cb, conn);
+    if (args & RP_SOURCE_SHORT_ADDR) hdr[i] = path[i].u8[0];
+    else memcpy(&hdr[1 + (i - 1) * sizeof(linkaddr_t)], &path[i], sizeof(linkaddr_t));
   }
+  conn->ns_stats.routed++;
+  return forward_enqueue(conn, &path[0]);
 }
 
-/*---------------------------------------------------------------------------*/
-/*                               Data Handling                               */
-/*---------------------------------------------------------------------------*/
-/* Header structure for data packets */
-struct collect_header {
-  linkaddr_t source;
-  linkaddr_t dest;
-  uint8_t hops;
-} __attribute__((packed));
 /*---------------------------------------------------------------------------*/
 typedef struct {
   uint16_t seqn;
@@ -322,20 +1581,45 @@ rp_send(struct rp_conn *conn, const linkaddr_t *dest)
 {
   routing_entry_t *route = lookup_route(dest, conn->is_sink);
 
-  if (route == NULL) {
+  if (route == NULL && !RP_FLOOD) {
     printf("rp_send: ERROR, route is null\n");
     return -1; // No route, cannot send
   } 
 
   struct collect_header hdr;
-  memcpy(&hdr.source, &linkaddr_node_addr, sizeof(linkaddr_t));
-  memcpy(&hdr.dest, dest, sizeof(linkaddr_t));
+  uint8_t buf[COLLECT_HDR_MAX_LEN];
+  linkaddr_copy(&hdr.source, &linkaddr_node_addr);
+  linkaddr_copy(&hdr.dest, dest);
   hdr.hops = 0;
+  hdr.seqn = conn->data_seqn++;
+  hdr.rank = 0; // data_stamp() sets it
+  uint8_t hdr_len = collect_header_write(buf, &hdr);
 
-  if (packetbuf_hdralloc(sizeof(struct collect_header))) 
+  if (packetbuf_hdralloc(hdr_len)) 
   {
-    memcpy(packetbuf_hdrptr(), &hdr, sizeof(hdr));
-    return unicast_send(&conn->uc, &route->next_hop); // send the packet to the next hop
+    linkaddr_t next_hop = linkaddr_null;
+    int ret;
+
+    memcpy(packetbuf_hdrptr(), buf, hdr_len);
+    if (route == NULL) 
+    { // our own copies of the flood come back, they are duplicates
+      printf("rp_send: no route to %02x:%02x, flooding\n", dest->u8[0], dest->u8[1]);
+      dup_cache_seen(conn, &hdr.source, hdr.seqn);
+      ret = flood_start(conn);
+    }
+    else if (RP_NONSTORING && conn->is_sink) ret = source_route_send(conn, dest);
+    else 
+    { // the packet goes to the next hop in turn
+      linkaddr_copy(&next_hop, data_next_hop(conn, dest, NULL, route));
+      ret = forward_enqueue(conn, &next_hop);
+    }
+
+    if (ret > 0 && congestion_ahead(conn, &next_hop)) 
+    {
+      conn->cong_stats.send_hints++;
+      return RP_SEND_CONGESTED;
+    }
+    return ret;
 
   } else {
     printf("rp_send: ERROR, packet buffer too small for header\n");
@@ -353,75 +1637,207 @@ tr_modify(struct topology_report *report)
   return;
 } */
 /*---------------------------------------------------------------------------*/
-/* Applying pending topology reports */
+/* Report state of a child, NULL if not tracked */
+static struct report_sync *
+find_report_sync(struct rp_conn *conn, const linkaddr_t *child)
+{
+  uint8_t i;
+  for (i = 0; i < MAX_REPORT_CHILDREN; i++) 
+  {
+    if (linkaddr_cmp(&conn->report_sync[i].child, child)) return &conn->report_sync[i];
+  }
+  return NULL;
+}
+
+static struct report_sync *
+get_report_sync(struct rp_conn *conn, const linkaddr_t *child)
+{
+  struct report_sync *s = find_report_sync(conn, child);
+  if (s == NULL) 
+  { // reuse the slots round robin, a forgotten child just gets a resync
+    s = &conn->report_sync[conn->report_sync_next];
+    conn->report_sync_next = (conn->report_sync_next + 1) % MAX_REPORT_CHILDREN;
+    memset(s, 0, sizeof(*s));
+    linkaddr_copy(&s->child, child);
+  }
+  return s;
+}
+
+/*---------------------------------------------------------------------------*/
+/* After the reports of the children, our own goes up in one batch */
 static void
 delayed_send_topology_report_cb(void *ptr)
 {
   struct rp_conn *conn = (struct rp_conn *)ptr;
   conn->report_timer_active = 0;
 
-  //printf("Applying %d pending topology reports\n", conn->pending_reports.count);
+  if (!conn->is_sink && !linkaddr_cmp(&conn->parent, &linkaddr_null)) 
+  {
+    report_mark_dirty(conn, "delayed batch");
+  }
+}
 
-  uint16_t i;
-  for ( i = 0; i < conn->pending_reports.count; ++i) 
+/* A child frame came: (re)start the wait for the end of the batch */
+static void
+report_batch_schedule(struct rp_conn *conn)
+{
+  clock_time_t now = clock_time(), delay;
+
+  conn->report_stats.frames_recv++;
+  if (!conn->report_timer_active) 
+  {
+    conn->report_timer_active = 1;
+    conn->report_batch_start = now;
+  }
+  else if (now - conn->report_last_rx < REPORT_BATCH_MAX) 
   {
-    update_routing_table(conn, &conn->pending_reports.reports[i]);
+    conn->report_gap = (3 * conn->report_gap + (now - conn->report_last_rx)) / 4;
+  }
+  conn->report_last_rx = now;
+
+  delay = 2 * conn->report_gap;
+  if (delay < REPORT_BATCH_MIN) delay = REPORT_BATCH_MIN;
+  if (delay > REPORT_BATCH_MAX) delay = REPORT_BATCH_MAX;
+  if (now + delay - conn->report_batch_start > REPORT_BATCH_MAX) 
+  { // the batch is closed at REPORT_BATCH_MAX whatever comes
+    delay = conn->report_batch_start + REPORT_BATCH_MAX - now;
   }
+  ctimer_set(&conn->report_delay_timer, delay, delayed_send_topology_report_cb, conn);
+}
 
-  conn->pending_reports.count = 0;
+/* Header of a report frame, the entries follow */
+#define REPORT_HDR_LEN offsetof(struct topology_report, subtree)
 
-  if (!conn->is_sink && !linkaddr_cmp(&conn->parent, &linkaddr_null)) 
+/* Apply a delta report of a child */
+static void
+apply_topology_delta(struct rp_conn *conn, const struct topology_report *report, uint8_t entries)
+{
+  linkaddr_t node;
+  memcpy(&node, &report->node, sizeof(linkaddr_t));
+
+  // the child itself, and everything still behind it is refreshed
+  add_route(conn, &node, &node, ROUTE_TOPOLOGY, report->metric, -95);
+  refresh_routes_by_next_hop(&node);
+
+  uint8_t i;
+  for (i = 0; i < entries; i++) 
   {
-    send_topology_report(conn, "delayed batch");
+    linkaddr_t dest;
+    memcpy(&dest, &report->subtree[i], sizeof(linkaddr_t));
+    if (linkaddr_cmp(&dest, &linkaddr_null)) continue;
+
+    if (i < report->added) 
+    {
+      add_route(conn, &dest, &node, ROUTE_TOPOLOGY, report->metric + 1, -95); // dummy RSSI
+      add_to_subtree(conn, &dest);
+    } 
+    else 
+    {
+      delete_route(&dest, &node);
+      remove_from_subtree(conn, &dest);
+    }
   }
 }
 
 /*---------------------------------------------------------------------------*/
-/* Node receives a Topology report */
-void
-tr_recv(struct rp_conn* conn)
+/* Non-storing mode: the parent report of a node, the sink keeps it and the
+   others pass it up as it is */
+static void
+parent_report_recv(struct rp_conn *conn)
 {
-  // my implementation before: each report is proceed independently 
-  // actually PDR in cooja is more with this implementation
-
-  /* 
-  struct topology_report report;
-  memcpy(&report, packetbuf_dataptr(), sizeof(report));
+  struct parent_report msg;
+  linkaddr_t node, parent;
 
-  update_routing_table(conn, &report);
+  if (!RP_NONSTORING || packetbuf_datalen() != sizeof(msg)) return;
+  memcpy(&msg, packetbuf_dataptr(), sizeof(msg));
+  memcpy(&node, &msg.node, sizeof(linkaddr_t));
+  memcpy(&parent, &msg.parent, sizeof(linkaddr_t));
 
-  //If the node is a sink, it does not forward topology reports
-  if (!conn->is_sink && !linkaddr_cmp(&conn->parent, &linkaddr_null)) 
+  if (conn->is_sink) add_route(conn, &node, &parent, ROUTE_SOURCE, msg.metric, -95);
+  else if (!linkaddr_cmp(&conn->parent, &linkaddr_null)) 
   {
-    //tr_modify(&report); // Modify the report if needed
-    //packetbuf_copyfrom(&report, sizeof(report));  
-    //unicast_send(&conn->uc, &conn->parent); 
-
-    send_topology_report(conn, "after report from child"); // send a topology report to the parent
+    unicast_send(&conn->uc, &conn->parent);
+    conn->ns_stats.relayed++;
+  }
+}
 
-  } 
-  return; */
+/*---------------------------------------------------------------------------*/
+/* Node receives a Topology report frame */
+static void
+tr_recv(struct rp_conn *conn, const linkaddr_t *from, uint8_t args)
+{
+  (void)from; // the report says whose it is
+  // before the reports were buffered (MAX_BUFFERED_REPORTS) and applied
+  // in a batch, now a frame is applied when it comes and only our own
+  // report waits for the batch: a report in fragments can't be buffered whole
 
-  // i wanted to buffer the reports and send them in a batch
   struct topology_report report;
-  memcpy(&report, packetbuf_dataptr(), sizeof(report));
+  uint16_t len = packetbuf_datalen();
 
-  // буфер
-  if (conn->pending_reports.count < MAX_BUFFERED_REPORTS) 
+  if (args & RP_REPORT_PARENT) 
   {
-    conn->pending_reports.reports[conn->pending_reports.count++] = report;
-  } 
-  else 
-  {
-    printf("tr_recv: Report buffer full, dropping report\n");
+    parent_report_recv(conn);
+    return;
   }
 
-  if (!conn->report_timer_active) 
+  if (len < REPORT_HDR_LEN || len > sizeof(report) 
+      || (len - REPORT_HDR_LEN) % sizeof(linkaddr_t) != 0) 
   {
-    conn->report_timer_active = 1;
-    ctimer_set(&conn->report_delay_timer, CLOCK_SECOND * 6, delayed_send_topology_report_cb, conn);
+    printf("tr_recv: bad report length %u\n", len);
+    return;
   }
-  
+  memset(&report, 0, sizeof(report));
+  memcpy(&report, packetbuf_dataptr(), len);
+  uint8_t entries = (len - REPORT_HDR_LEN) / sizeof(linkaddr_t);
+
+  linkaddr_t node;
+  memcpy(&node, &report.node, sizeof(linkaddr_t));
+  struct report_sync *sync = find_report_sync(conn, &node);
+
+  if (report.frags == 0) 
+  { // delta
+    if (sync == NULL || !sync->synced || sync->version != report.base_version 
+        || report.added > entries) 
+    { // we missed a report of this child: ask for the full one
+      conn->report_stats.resync_requests++;
+      send_report_resync(&conn->uc, &node);
+      return;
+    }
+    apply_topology_delta(conn, &report, entries);
+    sync->version = report.version;
+  }
+  else 
+  { // fragment of a full report
+    if (report.frag == 0) 
+    {
+      sync = get_report_sync(conn, &node);
+      sync->synced = false;
+      sync->rx_version = report.version;
+    }
+    else if (sync == NULL || sync->rx_version != report.version || sync->rx_next != report.frag) 
+    { // a fragment is missing, once per version
+      if (sync != NULL && sync->rx_version == report.version && sync->rx_next == REPORT_RX_LOST) return;
+      if (sync != NULL) 
+      {
+        sync->rx_version = report.version;
+        sync->rx_next = REPORT_RX_LOST;
+      }
+      conn->report_stats.resync_requests++;
+      send_report_resync(&conn->uc, &node);
+      return;
+    }
+
+    update_routing_table(conn, &report, entries);
+    sync->rx_next = report.frag + 1;
+    if (sync->rx_next < report.frags) return; // wait for the rest
+
+    sync->version = report.version;
+    sync->synced = true;
+    sync->rx_next = 0;
+  }
+
+  // forward our own report upwards with the next batch
+  report_batch_schedule(conn);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -429,13 +1845,16 @@ tr_recv(struct rp_conn* conn)
 void add_to_subtree(struct rp_conn *conn, const linkaddr_t *child) 
 {
   uint16_t i;
-  for ( i = 0; i < conn->subtree_size; i++) 
-    if (linkaddr_cmp(&conn->subtree[i], child)) return;
+  // not in the summary, not in the subtree
+  if (summary_has(conn->subtree_summary, SUBTREE_FILTER_BYTES, child))
+    for ( i = 0; i < conn->subtree_size; i++) 
+      if (linkaddr_cmp(&conn->subtree[i], child)) return;
 
   if (conn->subtree_size < MAX_SUBTREE_SIZE) 
   {
     memcpy(&conn->subtree[conn->subtree_size], child, sizeof(linkaddr_t));
     conn->subtree_size++;
+    subtree_summary_add(conn, child);
   } 
   else printf("add_to_subtree: Subtree full, cannot add %02x:%02x\n", child->u8[0], child->u8[1]);
   
@@ -443,6 +1862,7 @@ void add_to_subtree(struct rp_conn *conn, const linkaddr_t *child)
 /* Remove from the subtree */
 void remove_from_subtree(struct rp_conn *conn, const linkaddr_t *child) {
   uint16_t i;
+  if (!summary_has(conn->subtree_summary, SUBTREE_FILTER_BYTES, child)) return; // most routes are not
   for (i = 0; i < conn->subtree_size; i++) {
     if (linkaddr_cmp(&conn->subtree[i], child)) {
       // Сдвигаем остальные элементы влево
@@ -453,140 +1873,474 @@ void remove_from_subtree(struct rp_conn *conn, const linkaddr_t *child) {
       // Обнуляем последний
       memset(&conn->subtree[conn->subtree_size - 1], 0, sizeof(linkaddr_t));
       conn->subtree_size--;
+      subtree_summary_remove(conn, child);
       return;
     }
   }
 }
 /*---------------------------------------------------------------------------*/
-/* Unicast receive callback */
-void
-uc_recv(struct unicast_conn *uc_conn, const linkaddr_t *from)
+/* A node chose us as its parent */
+static void
+child_added(struct rp_conn *conn, const linkaddr_t *child, const linkaddr_t *from)
 {
-  /* Get the pointer to the overall structure rp_conn from its field uc */
-  struct rp_conn* conn = (struct rp_conn*)(((uint8_t*)uc_conn) - offsetof(struct rp_conn, uc));
+  if (RP_NONSTORING) return; // the sink learns it from the parent report
+  add_route(conn, child, from, ROUTE_TOPOLOGY, 100, -95);
+  if(!conn->is_sink) add_to_subtree(conn, child); 
+}
+
+/* A child moved to another parent */
+static void
+child_removed(struct rp_conn *conn, const linkaddr_t *child, const linkaddr_t *from)
+{
+  if (RP_NONSTORING) return;
+  // im deleting from the prev parent subtree from this child
+  delete_route_by_next_hop(conn, child, conn->is_sink); // delete all subtree
+  delete_route(child, child); // delete the route to the child
+  // also add this child as a neighbor (for sure they are neighbors)
+  add_route(conn, child, from, ROUTE_NEIGHBOR, 100, -95); 
+
+  report_mark_dirty(conn, "remove_child"); // our parent still routes it through us
+}
+
+/* A beacon says who the parent of its sender is: in piggyback mode this is
+   how children join and leave us */
+static void
+beacon_parent_recv(struct rp_conn *conn, const linkaddr_t *sender, const linkaddr_t *their_parent)
+{
+  if (linkaddr_cmp(sender, &conn->parent)) return;
 
-  /* ------------------------------------------------------ */
-  /*             check if it is a child message             */
-  /* ------------------------------------------------------ */
-  if (packetbuf_datalen() == sizeof(struct child_msg)) 
+  routing_entry_t *route = lookup_route(sender, true); // no parent fallback
+  bool is_child = route != NULL && route->type == ROUTE_TOPOLOGY 
+                  && linkaddr_cmp(&route->next_hop, sender);
+
+  if (linkaddr_cmp(their_parent, &linkaddr_node_addr)) 
   {
-    struct child_msg msg;
-    memset(&msg, 0, sizeof(msg));
-    memcpy(&msg, packetbuf_dataptr(), sizeof(msg));
+    if (!is_child) child_added(conn, sender, sender);
+    else route->last_updated = ROUTE_TIME_NOW(); // the child is alive
+  }
+  else if (is_child) child_removed(conn, sender, sender);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Node receives a child message */
+static void
+child_recv(struct rp_conn *conn, const linkaddr_t *from, uint8_t args)
+{
+  struct child_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(&msg, packetbuf_dataptr(), sizeof(msg));
 
-    linkaddr_t child_aligned;
-    memcpy(&child_aligned, &msg.child, sizeof(linkaddr_t)); 
+  linkaddr_t child_aligned;
+  memcpy(&child_aligned, &msg.child, sizeof(linkaddr_t)); 
 
-    switch (msg.type) {
-      case 0xA1: // ADD_CHILD 
-        add_route(conn, &child_aligned, from, ROUTE_TOPOLOGY, 100, -95);
-        if(!conn->is_sink) add_to_subtree(conn, &child_aligned); 
+  switch (args) {
+    case RP_CHILD_ADD:
+      child_added(conn, &child_aligned, from);
+      break;
 
-        break;
+    case RP_CHILD_REMOVE:
+      child_removed(conn, &child_aligned, from);
+      break;
 
-      case 0xA2: // REMOVE_CHILD
-        // im deleting from the prev parent subtree from this child
-        delete_route_by_next_hop(conn, &child_aligned, conn->is_sink); // delete all subtree
-        delete_route(&child_aligned, &child_aligned); // delete the route to the child
-        // also add this child as a neighbor (for sure they are neighbors)
-        add_route(conn, &child_aligned, from, ROUTE_NEIGHBOR, 100, -95); 
+    case RP_CHILD_RESYNC:
+      // the parent could not apply our delta: next report is a full one
+      if (linkaddr_cmp(from, &conn->parent)) 
+      {
+        conn->report_force_full = true;
+        report_mark_dirty(conn, "resync");
+      }
+      break;
 
-        send_topology_report(conn, "remove_child"); // send a topology report to the new parent
+    default:
+      break;
+  }
+}
 
-        break;
+/*---------------------------------------------------------------------------*/
+/* A frame going up from a child (as data_rank_check() sees it: not down,
+   from deeper than us) is a route to its source through the child */
+static void
+reverse_path_learn(struct rp_conn *conn, const struct collect_header *hdr, const linkaddr_t *from)
+{
+  uint8_t rank = hdr->rank & RP_DATA_RANK_MASK;
 
-      default:
-        break;
-    }
+  if ((hdr->rank & (RP_DATA_DOWN | RP_DATA_RANK_ERR)) || rank == RP_DATA_RANK_INFINITE 
+      || rank <= conn->metric) return;
 
+  routing_entry_t *e = lookup_route(&hdr->source, true); // no parent fallback
+  if (e != NULL && linkaddr_cmp(&e->next_hop, from)) 
+  { // keep its type, a topology route to the child tells it is a child
+    e->last_updated = ROUTE_TIME_NOW();
+    conn->rev_stats.refreshed++;
     return;
   }
 
-  /* ------------------------------------------------------ */
-  /*             check if it is a topology report           */
-  /* ------------------------------------------------------ */
-  if (packetbuf_datalen() == sizeof(struct topology_report)) 
+  add_route(conn, &hdr->source, from, ROUTE_REVERSE, conn->metric + hdr->hops, -95); // dummy RSSI
+  e = lookup_route(&hdr->source, true);
+  if (e != NULL && linkaddr_cmp(&e->next_hop, from)) 
+  { // it is below us, so in our subtree (and in our reports, see collect_subtree())
+    add_to_subtree(conn, &hdr->source);
+    conn->rev_stats.learned++;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Duplicate cache: true if (source, seqn) is in it, otherwise it goes in, in
+   place of the oldest entry */
+static bool
+dup_cache_seen(struct rp_conn *conn, const linkaddr_t *source, uint8_t seqn)
+{
+  uint8_t i;
+
+  for (i = 0; i < conn->dup_cache_len; i++) 
   {
-    tr_recv(conn);
-    return;
+    if (conn->dup_cache[i].seqn == seqn && linkaddr_cmp(&conn->dup_cache[i].source, source)) 
+    {
+      conn->dup_stats.hits++;
+      return true;
+    }
+  }
+
+  linkaddr_copy(&conn->dup_cache[conn->dup_cache_next].source, source);
+  conn->dup_cache[conn->dup_cache_next].seqn = seqn;
+  conn->dup_cache_next = (conn->dup_cache_next + 1) % DUP_CACHE_SIZE;
+  if (conn->dup_cache_len < DUP_CACHE_SIZE) conn->dup_cache_len++;
+  conn->dup_stats.misses++;
+  return false;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Datapath validation, as RPL does it: a frame going up must come from
+   deeper than us, one going down from not deeper than us (a repaired route
+   may go sideways). A first break of the order may be ranks not beaconed
+   yet: the frame is marked and goes on. A second one is a loop: false, the
+   frame is dropped. */
+static bool
+data_rank_check(struct rp_conn *conn, uint8_t *buf, const struct collect_header *hdr)
+{
+  uint8_t rank = hdr->rank & RP_DATA_RANK_MASK;
+  bool down = (hdr->rank & RP_DATA_DOWN) != 0;
+
+  if (rank == RP_DATA_RANK_INFINITE || conn->metric >= RP_DATA_RANK_INFINITE) return true;
+  if (down ? conn->metric >= rank : conn->metric < rank) return true;
+
+  conn->loop_stats.rank_errors++;
+  if (!down) beacon_trickle_reset(conn); // the sender has an old rank of ours
+  if (!(hdr->rank & RP_DATA_RANK_ERR)) 
+  {
+    buf[COLLECT_HDR_RANK] |= RP_DATA_RANK_ERR;
+    return true;
   }
 
-  /* ------------------------------------------------------ */
-  /*                check if it is a data packet            */
-  /* ------------------------------------------------------ */
-  if (packetbuf_datalen() < sizeof(struct collect_header)) 
+  printf("data_recv: drop, loop to %02x:%02x (rank %u %s, ours %u)\n", hdr->dest.u8[0], hdr->dest.u8[1],
+         rank, down ? "down" : "up", conn->metric);
+  conn->loop_stats.drops++;
+  return false;
+}
+
+/* The route to dest goes back to `from`, where the frame came from: a route
+   of ours to dest through it is stale, the parent may know better. Returns
+   the route to take, NULL if there is none. */
+static routing_entry_t *
+data_bounce(struct rp_conn *conn, const linkaddr_t *dest, const linkaddr_t *from, routing_entry_t *route)
+{
+  conn->loop_stats.bounces++;
+  if ((route->type == ROUTE_TOPOLOGY || route->type == ROUTE_REVERSE) && linkaddr_cmp(&route->destination, dest)) 
   {
-    printf("uc_recv: too short unicast packet %d\n", packetbuf_datalen());
-    return;
+    remove_from_subtree(conn, dest);
+    delete_route(dest, from);
+    route = lookup_route(dest, conn->is_sink);
+    if (route != NULL && !linkaddr_cmp(&route->next_hop, from)) return route;
   }
+  printf("data_recv: drop, loop to %02x:%02x through %02x:%02x\n", dest->u8[0], dest->u8[1], from->u8[0], from->u8[1]);
+  conn->loop_stats.drops++;
+  return NULL;
+}
 
+/*---------------------------------------------------------------------------*/
+/* Node receives a data packet */
+static void
+data_recv(struct rp_conn *conn, const linkaddr_t *from, uint8_t args)
+{
   struct collect_header hdr;
-  memcpy(&hdr, packetbuf_dataptr(), sizeof(hdr));
+  uint8_t *buf = packetbuf_dataptr();
+  uint8_t hdr_len = collect_header_read(buf, packetbuf_datalen(), &hdr);
+
+  if (hdr_len == 0) 
+  {
+    printf("data_recv: too short data packet %d\n", packetbuf_datalen());
+    return;
+  }
+
+  // A copy we have seen already (a lost ack, a parent switch on the way)
+  if (dup_cache_seen(conn, &hdr.source, hdr.seqn)) 
+  {
+    printf("data_recv: drop duplicate from %02x:%02x seqn %u\n", hdr.source.u8[0], hdr.source.u8[1], hdr.seqn);
+    return;
+  }
 
   // Check hop count limit
   if(hdr.hops + 1 > MAX_PATH_LENGTH) 
   {
-    printf("uc_recv: drop bc hop-limit exceeded (%d):\n", hdr.hops);
+    printf("data_recv: drop bc hop-limit exceeded (%d):\n", hdr.hops);
     return;
   }
 
   hdr.hops += 1; // Increment hop count
-  memcpy(packetbuf_dataptr(), &hdr, sizeof(hdr));
-  
-  linkaddr_t tmp_dest;
-  memcpy(&tmp_dest, &hdr.dest, sizeof(linkaddr_t));
+  buf[0] = RP_MSG_HDR(RP_MSG_DATA, (args & ~RP_DATA_HOPS_MASK) | hdr.hops);
+
+  if (RP_REVERSE_PATH && !RP_NONSTORING) reverse_path_learn(conn, &hdr, from);
+  neighbor_congestion(conn, from, (hdr.rank & RP_DATA_CONGESTED) != 0);
 
   /* Am I a destination? */
-  if(linkaddr_cmp(&linkaddr_node_addr, &tmp_dest)) 
+  if(linkaddr_cmp(&linkaddr_node_addr, &hdr.dest)) 
   {
-    if (packetbuf_hdrreduce(sizeof(struct collect_header))) 
+    if (packetbuf_hdrreduce(hdr_len)) 
     {
       if (packetbuf_datalen() != sizeof(test_msg_t)) 
       {
         return;
       }
 
-      test_msg_t msg;
-      memcpy(&msg, packetbuf_dataptr(), sizeof(msg));
+      conn->callbacks->recv(&hdr.source, hdr.hops);
+
+    }
+    else printf("data_recv: Header reduction failed!\n");
+    return;
+
+  }
+  else 
+  { /* Im not a destination, lets forward it */
+    routing_entry_t *route = NULL;
+    bool route_error = false; // `from` sent it down a route that loops
+
+    if (RP_NONSTORING && conn->is_sink) 
+    { // down again, on a source route
+      source_route_send(conn, &hdr.dest);
+      return;
+    }
+
+    if (data_rank_check(conn, buf, &hdr)) 
+    {
+      /*Check where to send with searching in the routing table*/
+      route = lookup_route(&hdr.dest, conn->is_sink);
+
+      if (route == NULL) 
+      { // No route, and no parent to fall back on
+        if (RP_FLOOD) flood_start(conn);
+        else printf("data_recv: ERROR, route is null\n");
+      }
+      else if (linkaddr_cmp(&route->next_hop, from)) 
+      {
+        route = data_bounce(conn, &hdr.dest, from, route);
+        route_error = (hdr.rank & RP_DATA_DOWN) != 0;
+      }
+    }
+    else route_error = (hdr.rank & RP_DATA_DOWN) != 0;
+
+    if (route != NULL) 
+    { // a frame on its way down takes no shortcut, it came from one maybe
+      forward_enqueue(conn, (hdr.rank & RP_DATA_DOWN) ? &route->next_hop : data_next_hop(conn, &hdr.dest, from, route));
+    }
+    if (route_error) send_route_error(conn, from, &hdr.dest); // the frame left the packetbuf
+    return; 
+  }
+
+}
+
+/*---------------------------------------------------------------------------*/
+static void rp_dispatch(struct rp_conn *conn, const linkaddr_t *from, bool broadcast);
+
+/* A data frame on a source route: the hops after us are in front of it */
+static void
+source_recv(struct rp_conn *conn, const linkaddr_t *from, uint8_t args)
+{
+  uint8_t *buf = packetbuf_dataptr();
+  uint8_t n = args & RP_SOURCE_HOPS_MASK;
+  uint8_t addr_len = (args & RP_SOURCE_SHORT_ADDR) ? 1 : sizeof(linkaddr_t);
+  uint8_t len = 1 + n * addr_len;
+  uint8_t *data = buf + len;
+  uint8_t hops;
+  linkaddr_t next;
+
+  if (packetbuf_datalen() < len + COLLECT_HDR_MIN_LEN || RP_MSG_TYPE(data[0]) != RP_MSG_DATA) 
+  {
+    printf("source_recv: bad frame, length %d\n", packetbuf_datalen());
+    return;
+  }
+
+  if (n == 0) 
+  { // we are the destination
+    if (packetbuf_hdrreduce(1)) rp_dispatch(conn, from, false);
+    return;
+  }
+
+  // count the hop in the data header, as data_recv() does
+  hops = RP_MSG_ARGS(data[0]) & RP_DATA_HOPS_MASK;
+  if (hops + 1 > MAX_PATH_LENGTH) 
+  {
+    printf("source_recv: drop bc hop-limit exceeded (%d):\n", hops);
+    return;
+  }
+  data[0] = RP_MSG_HDR(RP_MSG_DATA, (RP_MSG_ARGS(data[0]) & ~RP_DATA_HOPS_MASK) | (hops + 1));
+
+  // the next hop leaves the header
+  memset(&next, 0, sizeof(next));
+  memcpy(&next, &buf[1], addr_len);
+  buf[addr_len] = RP_MSG_HDR(RP_MSG_SOURCE, (n - 1) | (args & RP_SOURCE_SHORT_ADDR));
+  if (packetbuf_hdrreduce(addr_len)) forward_enqueue(conn, &next);
+}
+
+static void
+flood_timer_cb(void *ptr)
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+
+  if (conn->flood_qb == NULL) return;
+  queuebuf_to_packetbuf(conn->flood_qb);
+  queuebuf_free(conn->flood_qb);
+  conn->flood_qb = NULL;
+  broadcast_send(&conn->bc);
+  conn->flood_stats.forwarded++;
+}
+
+/* A flooded data frame. The destination takes it as any data frame, a node
+   with a route to it (not the parent fallback, not back to the sender)
+   sends it on in unicast, the others broadcast it again */
+static void
+flood_recv(struct rp_conn *conn, const linkaddr_t *from, uint8_t args)
+{
+  uint8_t ttl = args & RP_FLOOD_TTL_MASK;
+  uint8_t *data = (uint8_t *)packetbuf_dataptr() + 1;
+  struct collect_header hdr;
+  routing_entry_t *route;
+
+  if (RP_MSG_TYPE(data[0]) != RP_MSG_DATA 
+      || collect_header_read(data, packetbuf_datalen() - 1, &hdr) == 0) 
+  {
+    printf("flood_recv: bad frame, length %d\n", packetbuf_datalen());
+    return;
+  }
 
-      linkaddr_t tmp_src;
-      memcpy(&tmp_src, &hdr.source, sizeof(linkaddr_t));
-      conn->callbacks->recv(&tmp_src, hdr.hops);
+  if (linkaddr_cmp(&hdr.dest, &linkaddr_node_addr)) 
+  {
+    if (packetbuf_hdrreduce(1)) rp_dispatch(conn, from, false);
+    return;
+  }
 
+  if (dup_cache_seen(conn, &hdr.source, hdr.seqn)) 
+  {
+    conn->flood_stats.suppressed++;
+    if (conn->flood_qb != NULL && hdr.seqn == conn->flood_seqn 
+        && linkaddr_cmp(&hdr.source, &conn->flood_source)
+        && ++conn->flood_heard >= FLOOD_SUPPRESS) 
+    { // enough of the neighbors have it already
+      ctimer_stop(&conn->flood_timer);
+      queuebuf_free(conn->flood_qb);
+      conn->flood_qb = NULL;
+      conn->flood_stats.cancelled++;
     }
-    else printf("uc_recv: Header reduction failed!\n");
     return;
+  }
+  if (hdr.hops + 1 > MAX_PATH_LENGTH) return;
+  data[0] = RP_MSG_HDR(RP_MSG_DATA, (RP_MSG_ARGS(data[0]) & ~RP_DATA_HOPS_MASK) | (hdr.hops + 1));
+
+  route = lookup_route(&hdr.dest, true);
+  if (route != NULL && !linkaddr_cmp(&route->next_hop, from)) 
+  {
+    if (packetbuf_hdrreduce(1)) forward_enqueue(conn, &route->next_hop);
+    conn->flood_stats.converted++;
+  }
+  else if (ttl > 1 && conn->flood_qb == NULL) 
+  { // not right away, all the neighbors got it at the same time
+    *(uint8_t *)packetbuf_dataptr() = RP_MSG_HDR(RP_MSG_FLOOD, ttl - 1);
+    conn->flood_qb = queuebuf_new_from_packetbuf();
+    if (conn->flood_qb == NULL) return;
+    linkaddr_copy(&conn->flood_source, &hdr.source);
+    conn->flood_seqn = hdr.seqn;
+    conn->flood_heard = 0;
+    ctimer_set(&conn->flood_timer, 1 + random_rand() % FLOOD_JITTER, flood_timer_cb, conn);
+  }
+}
+
+/* A control message riding in front of another frame: the frame is handled
+   first (it may be forwarded as it is), then the control message */
+static void
+piggyback_recv(struct rp_conn *conn, const linkaddr_t *from, uint8_t args)
+{
+  uint8_t ctrl[PIGGYBACK_MAX_LEN];
+  uint8_t len = args;
 
+  if (len == 0 || packetbuf_datalen() < 1 + len + 1) 
+  {
+    printf("piggyback_recv: bad length %u/%d\n", len, packetbuf_datalen());
+    return;
   }
-  else 
-  { /* Im not a destination, lets forward it */
+  memcpy(ctrl, (uint8_t *)packetbuf_dataptr() + 1, len);
+  if (RP_MSG_TYPE(ctrl[0]) == RP_MSG_PIGGYBACK) return;
 
-    /*Check where to send with searching in the routing table*/
-    linkaddr_t tmp_dest;
-    memcpy(&tmp_dest, &hdr.dest, sizeof(linkaddr_t));
-    routing_entry_t *route = lookup_route(&tmp_dest, conn->is_sink);
+  if (packetbuf_hdrreduce(1 + len)) rp_dispatch(conn, from, false);
 
-    //print everything -- debugging
-    /* print_routing_table();
-    printf("uc_recv: Forwarding packet from hdr %02x:%02x -> %02x:%02x; from RT next-hop %02x:%02x -> dest %02x:%02x, hops %d\n",
-           hdr.source.u8[0], hdr.source.u8[1], hdr.dest.u8[0], hdr.dest.u8[1],
-           route->destination.u8[0], route->destination.u8[1],
-           route->next_hop.u8[0], route->next_hop.u8[1], hdr.hops); */
+  packetbuf_copyfrom(ctrl, len);
+  rp_dispatch(conn, from, false);
+}
 
-    if (route == NULL) 
-    {
-      printf("uc_recv: ERROR, route is null\n");
-      return; // No route, cannot send
-    }
+/*---------------------------------------------------------------------------*/
+/* Dispatch on the message type of the header byte */
+#define RP_VIA_BROADCAST 0x01
+#define RP_VIA_UNICAST 0x02
+
+struct rp_msg_handler {
+  void (* recv)(struct rp_conn *conn, const linkaddr_t *from, uint8_t args);
+  uint8_t via;      // RP_VIA_*: comes in broadcast (beacons), unicast or both
+  uint8_t min_len;  // shorter frames are dropped
+};
 
-    unicast_send(&conn->uc, &route->next_hop);
+static const struct rp_msg_handler rp_msg_handlers[RP_MSG_TYPES] = {
+  [RP_MSG_BEACON] = { beacon_recv, RP_VIA_BROADCAST, sizeof(struct beacon_msg) },
+  [RP_MSG_DATA] = { data_recv, RP_VIA_UNICAST, COLLECT_HDR_MIN_LEN },
+  [RP_MSG_CHILD] = { child_recv, RP_VIA_UNICAST, sizeof(struct child_msg) },
+  [RP_MSG_REPORT] = { tr_recv, RP_VIA_UNICAST, sizeof(struct parent_report) }, // the shorter one
+  [RP_MSG_PIGGYBACK] = { piggyback_recv, RP_VIA_UNICAST, 2 },
+  [RP_MSG_QUERY] = { query_recv, RP_VIA_BROADCAST | RP_VIA_UNICAST, sizeof(struct route_query) },
+  [RP_MSG_SOURCE] = { source_recv, RP_VIA_UNICAST, 1 + COLLECT_HDR_MIN_LEN },
+  [RP_MSG_FLOOD] = { flood_recv, RP_VIA_BROADCAST, 1 + COLLECT_HDR_MIN_LEN },
+};
 
-    linkaddr_t tmp_src2;
-    memcpy(&tmp_src2, &hdr.source, sizeof(linkaddr_t));
-    
-    return; 
+static void
+rp_dispatch(struct rp_conn *conn, const linkaddr_t *from, bool broadcast)
+{
+  if (packetbuf_datalen() < 1) return;
+
+  uint8_t hdr = *(uint8_t *)packetbuf_dataptr();
+  const struct rp_msg_handler *h = &rp_msg_handlers[RP_MSG_TYPE(hdr)];
+
+  if (h->recv == NULL || !(h->via & (broadcast ? RP_VIA_BROADCAST : RP_VIA_UNICAST)) 
+      || packetbuf_datalen() < h->min_len) 
+  {
+    printf("rp: drop message type %u (%s), length %d\n", RP_MSG_TYPE(hdr), 
+           broadcast ? "broadcast" : "unicast", packetbuf_datalen());
+    return;
   }
+  h->recv(conn, from, RP_MSG_ARGS(hdr));
+}
+
+/* Broadcast receive callback */
+void
+bc_recv(struct broadcast_conn *bc_conn, const linkaddr_t *sender)
+{
+  /* Get the pointer to the overall structure rp_conn from its field bc */
+  struct rp_conn* conn = (struct rp_conn*)(((uint8_t*)bc_conn) - offsetof(struct rp_conn, bc));
+  rp_dispatch(conn, sender, true);
+}
 
+/* Unicast receive callback */
+void
+uc_recv(struct unicast_conn *uc_conn, const linkaddr_t *from)
+{
+  /* Get the pointer to the overall structure rp_conn from its field uc */
+  struct rp_conn* conn = (struct rp_conn*)(((uint8_t*)uc_conn) - offsetof(struct rp_conn, uc));
+  rp_dispatch(conn, from, false);
 }
 /*---------------------------------------------------------------------------*/
 /*                              Route Management                             */
@@ -597,6 +2351,8 @@ int route_priority(route_type_t t) {
     case ROUTE_SELF: return 4;     // highest (never overwritten)
     case ROUTE_PARENT: return 3;
     case ROUTE_TOPOLOGY: return 2;
+    case ROUTE_SOURCE: return 2;
+    case ROUTE_REVERSE: return REVERSE_ROUTE_PRIORITY;
     case ROUTE_NEIGHBOR: return 1;
     default: return 0;
   }
@@ -612,56 +2368,41 @@ void add_route(struct rp_conn *conn, const linkaddr_t *destination, const linkad
     if (type != ROUTE_SELF) return; // Only allow self route with ROUTE_SELF
   }
 
-  routing_entry_node_t *current = routing_table;
-  clock_time_t now = clock_time();
+  int b = route_find_bucket(destination);
 
-  while (current != NULL) 
+  if (b < 0) 
   {
-    if (linkaddr_cmp(&current->entry.destination, destination)) 
-    {
-      int new_prio = route_priority(type);
-      int old_prio = route_priority(current->entry.type);
-
-      bool same_nexthop = linkaddr_cmp(&current->entry.next_hop, next_hop);
+    // route not found - create new
+    add_new_route(conn, destination, next_hop, type, metric, rssi);
+    return;
+  }
 
-      if (same_nexthop) 
-      {
-        if (new_prio >= old_prio /* || (new_prio == old_prio && rssi >= current->entry.rssi)  */)
-        {
-          current->entry.type = type;
-          current->entry.metric = metric;
-          current->entry.rssi = rssi;
-        }
-        current->entry.last_updated = now;
-        return;
+  routing_entry_t *current = &routes[route_index[b]];
+  int new_prio = route_priority(type);
+  int old_prio = route_priority(current->type);
 
-      } 
-      else 
-      {
-        if (new_prio >= old_prio /* || (new_prio == old_prio && rssi >= current->entry.rssi)  */) 
-        {
-          linkaddr_copy(&current->entry.next_hop, next_hop);
-          current->entry.type = type;
-          current->entry.metric = metric;
-          current->entry.rssi = rssi;
-          current->entry.last_updated = now;
-          return;
-
-        } 
-        else 
-        {
-          break;
-        }
-      }
-      break;
+  if (linkaddr_cmp(&current->next_hop, next_hop)) 
+  {
+    if (new_prio >= old_prio /* || (new_prio == old_prio && rssi >= current->rssi)  */)
+    {
+      current->type = type;
+      current->metric = metric;
+      current->rssi = rssi;
     }
-
-    current = current->next;
+    current->last_updated = ROUTE_TIME_NOW();
+  } 
+  else if (new_prio >= old_prio /* || (new_prio == old_prio && rssi >= current->rssi)  */) 
+  {
+    linkaddr_copy(&current->next_hop, next_hop);
+    current->type = type;
+    current->metric = metric;
+    current->rssi = rssi;
+    current->last_updated = ROUTE_TIME_NOW();
   }
+  // else: keep the higher priority route, one entry per destination
 
-  // route not found - create new
-  add_new_route(conn, destination, next_hop, type, metric, rssi);
-
+  if (current->type == ROUTE_PARENT) parent_route = current;
+  else if (current == parent_route) route_refresh_parent_cache();
 } 
 /*---------------------------------------------------------------------------*/
 /*  Adding a new route */
@@ -669,23 +2410,47 @@ void add_new_route(struct rp_conn *conn, const linkaddr_t *destination, const li
                uint16_t metric,
                int16_t rssi) 
 {
-  clock_time_t now = clock_time();
-  routing_entry_node_t *node = (routing_entry_node_t *)malloc(sizeof(routing_entry_node_t));
+  routing_entry_t *e = route_alloc(destination);
 
-  if (node == NULL) {
-    printf("add_route: ERROR - Out of memory adding route to %02x:%02x\n", destination->u8[0], destination->u8[1]);
+  (void)conn; // the table is per node, not per connection
+  if (e == NULL) {
+    printf("add_route: ERROR - Routing table full adding route to %02x:%02x\n", destination->u8[0], destination->u8[1]);
     return;
   }
   
-  linkaddr_copy(&node->entry.destination, destination);
-  linkaddr_copy(&node->entry.next_hop, next_hop);
-  node->entry.last_updated = now;
-  node->entry.type = type; 
-  node->entry.metric = metric; 
-  node->entry.rssi = rssi;
-  
-  node->next = routing_table;
-  routing_table = node;
+  linkaddr_copy(&e->next_hop, next_hop);
+  e->last_updated = ROUTE_TIME_NOW();
+  e->type = type; 
+  e->metric = metric; 
+  e->rssi = rssi;
+
+  if (type == ROUTE_PARENT) parent_route = e;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Point the route to destination at next_hop, whatever the route type (not
+   the self and parent routes) */
+void 
+patch_route(struct rp_conn *conn, const linkaddr_t *destination, const linkaddr_t *next_hop,
+            uint16_t metric, int16_t rssi)
+{
+  int b = route_find_bucket(destination);
+  route_type_t type = linkaddr_cmp(destination, next_hop) ? ROUTE_NEIGHBOR : ROUTE_TOPOLOGY;
+
+  if (b < 0) 
+  {
+    add_new_route(conn, destination, next_hop, type, metric, rssi);
+    return;
+  }
+
+  routing_entry_t *e = &routes[route_index[b]];
+  if (e->type == ROUTE_SELF || e->type == ROUTE_PARENT) return;
+
+  linkaddr_copy(&e->next_hop, next_hop);
+  e->type = type;
+  e->metric = metric;
+  e->rssi = rssi;
+  e->last_updated = ROUTE_TIME_NOW();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -693,29 +2458,15 @@ void add_new_route(struct rp_conn *conn, const linkaddr_t *destination, const li
 routing_entry_t 
 *lookup_route(const linkaddr_t *destination, bool is_sink) 
 {
-  routing_entry_node_t *current = routing_table;
-
   // 1. Try to find a direct match
-  while (current != NULL) 
+  int b = route_find_bucket(destination);
+  if (b >= 0) 
   {
-    if (linkaddr_cmp(&current->entry.destination, destination)) 
-    {
-      return &current->entry;
-    }
-    current = current->next;
+    return &routes[route_index[b]];
   }
 
-  // 2. Fallback: look for parent
-  if(!is_sink){
-    routing_entry_node_t *parent = routing_table;
-    while (parent != NULL) 
-    {
-      if (parent->entry.type == 1 || parent->entry.type == ROUTE_PARENT) return &parent->entry;
-      parent = parent->next;
-
-    }
-    
-  }
+  // 2. Fallback: the parent
+  if(!is_sink && parent_route != NULL) return parent_route;
 
   // 3. No route found
   //printf("lookup_route: No route found for destination %02x:%02x\n", destination->u8[0], destination->u8[1]);
@@ -726,37 +2477,20 @@ routing_entry_t
 void 
 purge_old_routes(struct rp_conn *conn) 
 {
-  routing_entry_node_t *prev = NULL;
-  routing_entry_node_t *current = routing_table;
-  clock_time_t now = clock_time();  
+  route_time_t now = ROUTE_TIME_NOW();
+  uint16_t i;
 
-  while (current != NULL) {
-    routing_entry_node_t *next = current->next;
+  for (i = 0; i < MAX_ROUTES; i++) {
+    routing_entry_t *e = route_slot(i);
+    if (e == NULL) continue;
 
-    if (  CLOCK_LT(current->entry.last_updated + cleanup_interval, now) 
-           && current->entry.type != 3 && current->entry.type != 1 
-           && current->entry.type != ROUTE_PARENT && current->entry.type != ROUTE_SELF // Do not purge self route and parent
+    if (  route_age(e, now) > cleanup_interval / CLOCK_SECOND 
+           && e->type != ROUTE_PARENT && e->type != ROUTE_SELF // Do not purge self route and parent
        )  
     { 
-      if (prev == NULL) 
-      {
-        routing_table = next;
-      } 
-      else 
-      {
-        prev->next = next;
-      }
-      
-      remove_from_subtree(conn, &current->entry.destination);
-      free(current);  // Free memory
-
+      remove_from_subtree(conn, &e->destination);
+      route_free(e);  // back to the pool
     } 
-    else 
-    {
-      prev = current;
-    }
-
-    current = next;  // Move to next route
   }
 }
 
@@ -764,72 +2498,78 @@ purge_old_routes(struct rp_conn *conn)
 //void func to delete route by destination and next hop
 void delete_route(const linkaddr_t *destination, const linkaddr_t *next_hop) 
 {
-  routing_entry_node_t *current = routing_table;
-  routing_entry_node_t *prev = NULL;
+  int b = route_find_bucket(destination);
+  if (b < 0) return;
 
-  while (current != NULL) {
-    if (linkaddr_cmp(&current->entry.destination, destination) && 
-        linkaddr_cmp(&current->entry.next_hop, next_hop)) 
-    {
-      if (prev == NULL) 
-      {
-        routing_table = current->next; // Remove from head
-      } 
-      else 
-      {
-        prev->next = current->next; // Remove from middle or end
-      }
+  routing_entry_t *e = &routes[route_index[b]];
+  if (linkaddr_cmp(&e->next_hop, next_hop)) 
+  {
+    route_free(e); // back to the pool
+  }
+}
+/*---------------------------------------------------------------------------*/
+// Refresh the timestamp of every route through a next hop
+void refresh_routes_by_next_hop(const linkaddr_t *next_hop) 
+{
+  route_time_t now = ROUTE_TIME_NOW();
+  uint16_t i;
 
-      free(current); // Free memory
-      return;
+  for (i = 0; i < MAX_ROUTES; i++) {
+    routing_entry_t *e = route_slot(i);
+    if (e != NULL && linkaddr_cmp(&e->next_hop, next_hop)) e->last_updated = now;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* First fragment of a full report: every route through the child is stale
+   until the report has it again */
+static void
+mark_routes_by_next_hop(const linkaddr_t *next_hop)
+{
+  uint16_t i;
 
-    }
-    prev = current;
-    current = current->next;
+  for (i = 0; i < MAX_ROUTES; i++) {
+    routing_entry_t *e = route_slot(i);
+    if (e != NULL && linkaddr_cmp(&e->next_hop, next_hop)) ROUTE_STALE_SET(i);
   }
+}
+
+/* Last fragment: the routes through the child still stale go away. The
+   marks of the routes through other children stay, their reports may be
+   in the middle of their fragments too. */
+static uint16_t
+sweep_routes_by_next_hop(struct rp_conn *conn, const linkaddr_t *next_hop)
+{
+  uint16_t i, n = 0;
+
+  for (i = 0; i < MAX_ROUTES; i++) {
+    routing_entry_t *e = route_slot(i);
+    if (e == NULL || !ROUTE_STALE(i) || !linkaddr_cmp(&e->next_hop, next_hop)) continue;
+    ROUTE_STALE_CLEAR(i);
+    if (e->type == ROUTE_SELF || e->type == ROUTE_PARENT) continue;
 
+    remove_from_subtree(conn, &e->destination);
+    route_free(e);
+    n++;
+  }
+  return n;
 }
 /*---------------------------------------------------------------------------*/
 // Function to delete routes by next hop
 void delete_route_by_next_hop(struct rp_conn *conn, const linkaddr_t *next_hop, bool is_sink) 
 {
-  routing_entry_node_t *current = routing_table;
-  routing_entry_node_t *prev = NULL;
-
-  while (current != NULL) {
-    routing_entry_node_t *next = current->next;  // Save next before potentially freeing
-    if (linkaddr_cmp(&current->entry.next_hop, next_hop)) 
-    {
-
-      if (is_sink && current->entry.type == 0) {
-        prev = current; // Do not delete self route in sink
-        current = next;
-        continue;
-      }
+  uint16_t i;
 
-      if (prev == NULL) 
-      {
-        routing_table = next; // Remove head
-      } 
-      else 
-      {
-        prev->next = next; // Bypass current
-      }
-      
-      // delete destination from subtree
-      remove_from_subtree(conn, &current->entry.destination);
+  for (i = 0; i < MAX_ROUTES; i++) {
+    routing_entry_t *e = route_slot(i);
+    if (e == NULL || !linkaddr_cmp(&e->next_hop, next_hop)) continue;
 
-      free(current);
+    if (is_sink && e->type == ROUTE_TOPOLOGY) continue; // the sink keeps its topology routes
 
-    } 
-    else 
-    {
-      prev = current;
-    }
-    current = next;
+    // delete destination from subtree
+    remove_from_subtree(conn, &e->destination);
 
+    route_free(e);
   }
-
 }
 /*---------------------------------------------------------------------------*/
 /* Cleanup timer callback */
@@ -838,117 +2578,433 @@ cleanup_timer_callback(void *ptr)
 {
   struct rp_conn *conn = (struct rp_conn *)ptr;
   if(!conn->is_sink) purge_old_routes(conn);
+  print_route_pool_stats();
+  printf("Reports [Node %02x:%02x]: full %u, delta %u, frames %u, resync requests %u, child frames %u, coalesced %u, routes added %u, removed %u, refreshed %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->report_stats.full_sent, conn->report_stats.delta_sent,
+         conn->report_stats.frames_sent, conn->report_stats.resync_requests,
+         conn->report_stats.frames_recv, conn->report_stats.coalesced,
+         conn->report_stats.routes_added, conn->report_stats.routes_removed,
+         conn->report_stats.routes_refreshed);
+  printf("Piggyback [Node %02x:%02x]: carried %u, standalone %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->pb_stats.carried, conn->pb_stats.standalone);
+  printf("Beacons [Node %02x:%02x]: sent %u, suppressed %u, resets %u, interval %lu s, seqn %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->beacon_stats.sent, conn->beacon_stats.suppressed,
+         conn->beacon_stats.resets, (unsigned long)(conn->trickle_i / CLOCK_SECOND),
+         conn->beacon_seqn);
+  printf("Neighbors [Node %02x:%02x]: %u/%u, tx ok %u, noack %u, collisions %u, evictions %u, failovers %u, path etx %u.%02u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         neighbors_used, MAX_NEIGHBORS, conn->nbr_stats.tx_ok, conn->nbr_stats.tx_noack,
+         conn->nbr_stats.tx_collisions, conn->nbr_stats.evictions, conn->nbr_stats.failovers, 
+         conn->path_etx / ETX_SCALE, 
+         (conn->path_etx % ETX_SCALE) * 100 / ETX_SCALE);
+  printf("Forward [Node %02x:%02x]: sent %u, tx failed %u, drops %u, shortcuts %u, queued %u, high-water %u/%u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->fwd_stats.sent, conn->fwd_stats.tx_failed, conn->fwd_stats.drops,
+         conn->fwd_stats.shortcuts, conn->fwd_len, conn->fwd_stats.high_water, FORWARD_QUEUE_LEN);
+  printf("Repair [Node %02x:%02x]: direct %u, queried %u, repaired %u, failed %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->repair_stats.direct, conn->repair_stats.queried,
+         conn->repair_stats.repaired, conn->repair_stats.failed);
+  printf("Duplicates [Node %02x:%02x]: hits %u, misses %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->dup_stats.hits, conn->dup_stats.misses);
+  if (RP_NONSTORING) 
+  {
+    printf("Non-storing [Node %02x:%02x]: reports relayed %u, source routed %u, no route %u\n",
+           linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+           conn->ns_stats.relayed, conn->ns_stats.routed, conn->ns_stats.no_route);
+  }
+  printf("Loops [Node %02x:%02x]: rank errors %u, bounces %u, drops %u, route errors %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->loop_stats.rank_errors, conn->loop_stats.bounces,
+         conn->loop_stats.drops, conn->loop_stats.route_errors);
+  printf("Reverse [Node %02x:%02x]: learned %u, refreshed %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->rev_stats.learned, conn->rev_stats.refreshed);
+  printf("Flood [Node %02x:%02x]: started %u, forwarded %u, converted %u, suppressed %u, cancelled %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
+         conn->flood_stats.started, conn->flood_stats.forwarded,
+         conn->flood_stats.converted, conn->flood_stats.suppressed,
+         conn->flood_stats.cancelled);
+  printf("Congestion [Node %02x:%02x]: %s, onsets %u, heard %u, avoided %u, send hints %u, fail rate %u\n",
+         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1], conn->congested ? "congested" : "clear",
+         conn->cong_stats.onsets, conn->cong_stats.heard, conn->cong_stats.avoided,
+         conn->cong_stats.send_hints, conn->tx_fail_rate);
   ctimer_reset(&conn->cleanup_timer);  // Reschedule the timer
 } 
 /*---------------------------------------------------------------------------*/
 /* Sending topology reports */
-void
-send_topology_report(void *ptr, char* lol) 
+/* Current subtree of this node, what it reports to the parent */
+static uint16_t
+collect_subtree(linkaddr_t *subtree, const char *lol)
 {
-  struct rp_conn *conn = (struct rp_conn *)ptr;
-  if (conn->is_sink) return; // Sink doesn't send reports
-
-  struct topology_report report;
-  memset(&report, 0, sizeof(report));  // clear garbage
-
-  // Fill the report with current node and metric
-  memcpy(&report.node, &linkaddr_node_addr, sizeof(linkaddr_t));
-  report.metric = conn->metric; 
-
-  uint8_t subtree_index = 0; 
-
-  routing_entry_node_t *current = routing_table;
+  uint16_t subtree_index = 0; 
+  uint16_t i;
 
-  while (current != NULL) 
+  for (i = 0; i < MAX_ROUTES; i++) 
   {
-    const linkaddr_t *dest = &current->entry.destination;
+    routing_entry_t *e = route_slot(i);
+    if (e == NULL) continue;
+
+    const linkaddr_t *dest = &e->destination;
 
     if 
     ( subtree_index < MAX_SUBTREE_SIZE && !linkaddr_cmp(dest, &linkaddr_null) 
-      && ( current->entry.type == ROUTE_TOPOLOGY || current->entry.type == ROUTE_SELF ) // only add subtree
+      && ( e->type == ROUTE_TOPOLOGY || e->type == ROUTE_REVERSE || e->type == ROUTE_SELF ) // only add subtree
     )
     { 
       printf("debug: [%s] send_topology_report: Adding subtree node %02x:%02x \n", lol, dest->u8[0], dest->u8[1]);
 
-      memcpy(&report.subtree[subtree_index], dest, sizeof(linkaddr_t));
+      linkaddr_copy(&subtree[subtree_index], dest);
       subtree_index++;
     }
-    current = current->next;
-    
   }
+  return subtree_index;
+}
 
-  // Set the subtree size in the report
-  report.subtree_size = subtree_index; 
+/* Next report of this node in one frame: a delta if it can, else a full
+   report. Returns the entries of the frame, or -1 if the full report needs
+   more than one fragment (report has its header). Nothing is committed. */
+static int
+next_report_frame(struct rp_conn *conn, const linkaddr_t *subtree, uint16_t subtree_index,
+                  struct topology_report *report)
+{
+  uint16_t i, j;
 
-  //packetbuf_clear();
-  packetbuf_copyfrom(&report, sizeof(struct topology_report));
+  memset(report, 0, sizeof(*report));  // clear garbage
+
+  // Fill the report with current node and metric
+  report->type = RP_MSG_HDR(RP_MSG_REPORT, 0);
+  memcpy(&report->node, &linkaddr_node_addr, sizeof(linkaddr_t));
+  report->metric = conn->metric; 
+  report->base_version = conn->report_version;
+  report->version = conn->report_version + 1;
+
+  bool full = !TOPOLOGY_DELTA_REPORTS || conn->report_force_full
+              || conn->reports_since_full >= TOPOLOGY_FULL_REPORT_EVERY
+              || !linkaddr_cmp(&conn->reported_parent, &conn->parent);
+  uint16_t n = 0;
+
+  if (!full) 
+  { // only the changes since the previous report, if they fit in one frame
+    for (i = 0; i < subtree_index && !full; i++) 
+    {
+      for (j = 0; j < conn->reported_size; j++) 
+        if (linkaddr_cmp(&subtree[i], &conn->reported[j])) break;
+      if (j < conn->reported_size) continue;
+
+      if (n == REPORT_FRAME_ENTRIES) full = true;
+      else memcpy(&report->subtree[n++], &subtree[i], sizeof(linkaddr_t));
+    }
+    report->added = n;
+    for (j = 0; j < conn->reported_size && !full; j++) 
+    {
+      for (i = 0; i < subtree_index; i++) 
+        if (linkaddr_cmp(&subtree[i], &conn->reported[j])) break;
+      if (i < subtree_index) continue;
+
+      if (n == REPORT_FRAME_ENTRIES) full = true;
+      else memcpy(&report->subtree[n++], &conn->reported[j], sizeof(linkaddr_t));
+    }
+    if (n >= subtree_index) full = true; // the full report is not bigger
+    if (!full) return n;
+  }
+
+  // full report, in as many fragments as needed, always at least one
+  report->added = 0;
+  report->frags = (subtree_index + REPORT_FRAME_ENTRIES - 1) / REPORT_FRAME_ENTRIES;
+  if (report->frags == 0) report->frags = 1;
+  if (report->frags > 1) return -1;
+
+  memcpy(report->subtree, subtree, subtree_index * sizeof(linkaddr_t));
+  return subtree_index;
+}
+
+/* The report is on its way to the parent */
+static void
+commit_report(struct rp_conn *conn, const struct topology_report *report,
+              const linkaddr_t *subtree, uint16_t subtree_index)
+{
+  conn->report_version = report->version;
+  if (report->frags == 0) 
+  {
+    conn->reports_since_full++;
+    conn->report_stats.delta_sent++;
+  } 
+  else 
+  {
+    conn->reports_since_full = 0;
+    conn->report_force_full = false;
+    conn->report_stats.full_sent++;
+  }
+
+  // this is what the parent has now (if a delta is lost it asks for a resync)
+  memcpy(conn->reported, subtree, subtree_index * sizeof(linkaddr_t));
+  conn->reported_size = subtree_index;
+  linkaddr_copy(&conn->reported_parent, &conn->parent);
+}
+
+/* Non-storing mode: all there is to report */
+static void
+parent_report_build(struct rp_conn *conn, struct parent_report *msg)
+{
+  msg->type = RP_MSG_HDR(RP_MSG_REPORT, RP_REPORT_PARENT);
+  memcpy(&msg->node, &linkaddr_node_addr, sizeof(linkaddr_t));
+  memcpy(&msg->parent, &conn->parent, sizeof(linkaddr_t));
+  msg->metric = conn->metric;
+}
+
+static void
+send_topology_report_now(struct rp_conn *conn, char* lol) 
+{
+  linkaddr_t subtree[MAX_SUBTREE_SIZE];
+  uint16_t subtree_index = collect_subtree(subtree, lol);
+  uint16_t i, n;
 
   // Send the report to the parent
-  if (!linkaddr_cmp(&conn->parent, &linkaddr_null)) 
-  { 
+  if (linkaddr_cmp(&conn->parent, &linkaddr_null)) return;
+
+  if (RP_NONSTORING) 
+  {
+    struct parent_report msg;
+    parent_report_build(conn, &msg);
+    packetbuf_copyfrom(&msg, sizeof(msg));
+    unicast_send(&conn->uc, &conn->parent);
+    conn->report_stats.frames_sent++;
+    return;
+  }
+
+  struct topology_report report;
+  int entries = next_report_frame(conn, subtree, subtree_index, &report);
+
+  //packetbuf_clear();
+  if (entries >= 0) 
+  {
+    packetbuf_copyfrom(&report, REPORT_HDR_LEN + entries * sizeof(linkaddr_t));
     unicast_send(&conn->uc, &conn->parent);
+    conn->report_stats.frames_sent++;
   } 
+  else 
+  {
+    for (i = 0; i < report.frags; i++) 
+    {
+      n = subtree_index - i * REPORT_FRAME_ENTRIES;
+      if (n > REPORT_FRAME_ENTRIES) n = REPORT_FRAME_ENTRIES;
+
+      report.frag = i;
+      memcpy(report.subtree, &subtree[i * REPORT_FRAME_ENTRIES], n * sizeof(linkaddr_t));
+      packetbuf_copyfrom(&report, REPORT_HDR_LEN + n * sizeof(linkaddr_t));
+      unicast_send(&conn->uc, &conn->parent);
+      conn->report_stats.frames_sent++;
+    }
+  }
+  commit_report(conn, &report, subtree, subtree_index);
   
   // Reschedule the next report -- now I do not use timer for reports
   //ctimer_set(&conn->report_timer, TOPOLOGY_REPORT_INTERVAL, send_topology_report, conn);
 }
 
+/* Tokens earned since the last one, REPORT_BURST at most */
+static void
+report_tokens_refill(struct rp_conn *conn)
+{
+  clock_time_t n = (clock_time() - conn->report_token_time) / REPORT_MIN_INTERVAL;
+
+  if (n == 0) return;
+  if (conn->report_tokens + n >= REPORT_BURST) 
+  {
+    conn->report_tokens = REPORT_BURST;
+    conn->report_token_time = clock_time();
+  }
+  else 
+  {
+    conn->report_tokens += n;
+    conn->report_token_time += n * REPORT_MIN_INTERVAL;
+  }
+}
+
+static void report_sched_cb(void *ptr);
+
+/* Send the dirty report if there is a token, otherwise wait for the next */
+static void
+report_schedule(struct rp_conn *conn)
+{
+  if (!conn->report_dirty) return;
+  if (linkaddr_cmp(&conn->parent, &linkaddr_null)) return; // it goes to the next parent
+
+  report_tokens_refill(conn);
+  if (conn->report_tokens > 0) 
+  {
+    conn->report_tokens--;
+    conn->report_dirty = false;
+    ctimer_stop(&conn->report_sched_timer);
+    send_topology_report(conn, "scheduled");
+    return;
+  }
+  ctimer_set(&conn->report_sched_timer,
+             conn->report_token_time + REPORT_MIN_INTERVAL - clock_time()
+             + random_rand() % (REPORT_MIN_INTERVAL / 4 + 1),
+             report_sched_cb, conn);
+}
+
+static void
+report_sched_cb(void *ptr)
+{
+  report_schedule((struct rp_conn *)ptr);
+}
+
+/* What we report changed: it goes up when the bucket lets it */
+static void
+report_mark_dirty(struct rp_conn *conn, char* lol)
+{
+  (void)lol; // the reason is for the log of the report that goes
+  if (conn->is_sink) return;
+
+  if (conn->report_dirty || (conn->pb_pending & PB_REPORT)) 
+  { // a report is due already, it is built when it goes
+    conn->report_stats.coalesced++;
+    return;
+  }
+  conn->report_dirty = true;
+  report_schedule(conn);
+}
+
+/* Parent change: no waiting for a token, but it takes one if there is, and
+   no waiting for a frame to carry it either */
+static void
+report_send_now(struct rp_conn *conn, char* lol)
+{
+  if (conn->is_sink) return;
+
+  report_tokens_refill(conn);
+  if (conn->report_tokens > 0) conn->report_tokens--;
+  conn->report_dirty = false;
+  ctimer_stop(&conn->report_sched_timer);
+  conn->pb_pending &= ~PB_REPORT; // this one is newer
+  if (conn->pb_pending == 0) ctimer_stop(&conn->pb_timer);
+  send_topology_report_now(conn, lol);
+}
+
+void
+send_topology_report(void *ptr, char* lol) 
+{
+  struct rp_conn *conn = (struct rp_conn *)ptr;
+  if (conn->is_sink) return; // Sink doesn't send reports
+
+  if (RP_PIGGYBACK && !linkaddr_cmp(&conn->parent, &linkaddr_null)) 
+  { // on the next data frame to the parent, or at the deadline
+    piggyback_defer(conn, PB_REPORT);
+    return;
+  }
+  send_topology_report_now(conn, lol);
+}
+
+/* Put the pending report in front of the data frame in packetbuf, if it
+   goes to the parent and the report fits in one small frame */
+static void
+piggyback_attach(struct rp_conn *conn, const linkaddr_t *next_hop)
+{
+  if (!(conn->pb_pending & PB_REPORT) || !linkaddr_cmp(next_hop, &conn->parent)) return;
+
+  if (RP_NONSTORING) 
+  {
+    struct parent_report msg;
+    uint8_t *hdr;
+
+    if (!packetbuf_hdralloc(1 + sizeof(msg))) return;
+    parent_report_build(conn, &msg);
+    hdr = packetbuf_hdrptr();
+    hdr[0] = RP_MSG_HDR(RP_MSG_PIGGYBACK, sizeof(msg));
+    memcpy(&hdr[1], &msg, sizeof(msg));
+    piggyback_carried(conn, PB_REPORT);
+    return;
+  }
+
+  linkaddr_t subtree[MAX_SUBTREE_SIZE];
+  uint16_t subtree_index = collect_subtree(subtree, "piggyback");
+  struct topology_report report;
+  int entries = next_report_frame(conn, subtree, subtree_index, &report);
+  if (entries < 0) return; // fragments go at the deadline
+
+  uint8_t len = REPORT_HDR_LEN + entries * sizeof(linkaddr_t);
+  if (len > PIGGYBACK_MAX_LEN || !packetbuf_hdralloc(1 + len)) return;
+
+  uint8_t *hdr = packetbuf_hdrptr();
+  hdr[0] = RP_MSG_HDR(RP_MSG_PIGGYBACK, len);
+  memcpy(&hdr[1], &report, len);
+
+  commit_report(conn, &report, subtree, subtree_index);
+  piggyback_carried(conn, PB_REPORT);
+}
+
 /*---------------------------------------------------------------------------*/
+/* One entry of a full report of node: refreshed in place if the route goes
+   through node already, otherwise add_route() decides */
+static void
+report_entry_apply(struct rp_conn *conn, const linkaddr_t *dest, const linkaddr_t *node, uint16_t metric)
+{
+  int b = route_find_bucket(dest);
+  routing_entry_t *e = NULL;
+
+  if (b >= 0) 
+  {
+    ROUTE_STALE_CLEAR(route_index[b]);
+    e = &routes[route_index[b]];
+    if (linkaddr_cmp(&e->next_hop, node)) 
+    {
+      if (route_priority(ROUTE_TOPOLOGY) >= route_priority(e->type)) 
+      {
+        e->type = ROUTE_TOPOLOGY;
+        e->metric = metric;
+        e->rssi = -95; // dummy RSSI
+      }
+      e->last_updated = ROUTE_TIME_NOW();
+      conn->report_stats.routes_refreshed++;
+      return;
+    }
+  }
+
+  uint16_t used = route_pool.used;
+  add_route(conn, dest, node, ROUTE_TOPOLOGY, metric, -95); // dummy RSSI
+  if (e != NULL ? linkaddr_cmp(&e->next_hop, node) : route_pool.used != used) conn->report_stats.routes_added++;
+}
+
 /*  To update RT from the report */
 void 
-update_routing_table(struct rp_conn *conn, const struct topology_report *report) 
+update_routing_table(struct rp_conn *conn, const struct topology_report *report, uint8_t entries) 
 {
-  // i want to delete all routes which has next hop as the node in the report
+  // A full report is reconciled with the routes we have through the child,
+  // so what did not change is not freed and allocated again: its first
+  // fragment marks them stale, the entries of the report are refreshed or
+  // added, and after the last fragment what is still stale goes away.
+  // Not at the sink: it keeps its topology routes anyway, and the entries of
+  // the report overwrite their next hop in place, without a scan of the table
   linkaddr_t node_aligned;
   memcpy(&node_aligned, &report->node, sizeof(linkaddr_t));
 
-  delete_route_by_next_hop(conn, &node_aligned, conn->is_sink);
-  add_route(conn, &node_aligned, &node_aligned, ROUTE_TOPOLOGY, report->metric, -95);
+  if (report->frag == 0 && !conn->is_sink) mark_routes_by_next_hop(&node_aligned);
+  report_entry_apply(conn, &node_aligned, &node_aligned, report->metric);
 
   // Add routes from the report
   uint8_t i;
-  for (i = 0; i < report->subtree_size && i < MAX_SUBTREE_SIZE; i++) 
+  for (i = 0; i < entries && i < REPORT_FRAME_ENTRIES; i++) 
   {
     linkaddr_t tmp_addr;
     memcpy(&tmp_addr, &report->subtree[i], sizeof(linkaddr_t));
     if(!linkaddr_cmp(&tmp_addr, &linkaddr_null))
     {
-      linkaddr_t tmp_parent;
-      memcpy(&tmp_parent, &report->node, sizeof(linkaddr_t));
-      add_route(conn, &tmp_addr, &tmp_parent, ROUTE_TOPOLOGY, report->metric + 1, -95); // dummy RSSI
+      report_entry_apply(conn, &tmp_addr, &node_aligned, report->metric + 1);
 
+      // Add subtree nodes to the connection's subtree
+      add_to_subtree(conn, &tmp_addr);
     }
   }
 
-  // Add subtree nodes to the connection's subtree
-  for (i = 0; i < report->subtree_size && conn->subtree_size < MAX_SUBTREE_SIZE; i++) 
+  if (report->frag + 1 >= report->frags && !conn->is_sink) 
   {
-    //const linkaddr_t *node = &report->subtree[i];
-    linkaddr_t node;
-    memcpy(&node, &report->subtree[i], sizeof(linkaddr_t));
-
-
-    if (!linkaddr_cmp(&node, &linkaddr_null)) 
-    { 
-      bool already_present = false;
-      uint16_t j;
-      for (  j = 0; j < conn->subtree_size; j++) 
-      {
-        if (linkaddr_cmp(&conn->subtree[j], &node)) 
-        {
-          already_present = true;
-          break;
-
-        }
-      }
- 
-      if (!already_present && conn->subtree_size < MAX_SUBTREE_SIZE) 
-      {
-        memcpy(&conn->subtree[conn->subtree_size], &node, sizeof(linkaddr_t));
-        conn->subtree_size++;
-
-      }
-    }
+    conn->report_stats.routes_removed += sweep_routes_by_next_hop(conn, &node_aligned);
   }
-
 }
@@ -13,47 +13,478 @@
 #endif
 
 /*---------------------------------------------------------------------------*/
+/* Message header: every rp frame, broadcast or unicast, starts with one byte.
+   The top 3 bits are the message type, the receiver dispatches on it (see
+   rp_msg_handlers in rp.c). The low 5 bits depend on the type. */
+#define RP_MSG_HDR(type, args) ((uint8_t)(((type) << 5) | ((args) & 0x1F)))
+#define RP_MSG_TYPE(hdr) ((uint8_t)(hdr) >> 5)
+#define RP_MSG_ARGS(hdr) ((hdr) & 0x1F)
+
+typedef enum {
+  RP_MSG_BEACON = 0,
+  RP_MSG_DATA = 1,   // args: hop count and RP_DATA_SHORT_ADDR
+  RP_MSG_CHILD = 2,  // args: one of rp_child_msg_t
+  RP_MSG_REPORT = 3,
+  RP_MSG_PIGGYBACK = 4, // args: length of the control message in front
+  RP_MSG_QUERY = 5,     // args: RP_QUERY_REPLY
+  RP_MSG_SOURCE = 6,    // args: hops still to go and RP_SOURCE_SHORT_ADDR
+  RP_MSG_FLOOD = 7,     // args: hops the flood still goes (RP_FLOOD_TTL_MASK)
+  RP_MSG_TYPES = 8
+} rp_msg_type_t;
+
+typedef enum {
+  RP_CHILD_ADD = 1,
+  RP_CHILD_REMOVE = 2,
+  RP_CHILD_RESYNC = 3 // the parent asks for a full topology report
+} rp_child_msg_t;
+
+/* Data packets carry the hop count in the header byte, then the seqn of the
+   source, the rank byte, and the source and destination in one byte each
+   when both addresses fit (u8[1] == 0). The rank byte is set by each hop
+   before it sends: its hop metric (RP_DATA_RANK_INFINITE without a parent),
+   RP_DATA_DOWN if the next hop is not its parent, RP_DATA_CONGESTED if it is
+   congested itself, and RP_DATA_RANK_ERR once a hop went against the rank
+   order (see data_rank_check() in rp.c). */
+#define RP_DATA_HOPS_MASK 0x0F
+#define RP_DATA_SHORT_ADDR 0x10
+#define RP_DATA_RANK_MASK 0x1F
+#define RP_DATA_RANK_INFINITE RP_DATA_RANK_MASK
+#define RP_DATA_CONGESTED 0x20
+#define RP_DATA_DOWN 0x40
+#define RP_DATA_RANK_ERR 0x80
+
+/* Beacons may go on with the address of the sender's parent, then with the
+   summary of its subtree. RP_BEACON_CONGESTED goes alone. */
+#define RP_BEACON_PARENT 0x01
+#define RP_BEACON_SUMMARY 0x02
+#define RP_BEACON_CONGESTED 0x04
+
+/* Source route in front of a data frame (non-storing mode): the addresses of
+   the hops after the receiver, in order, one byte each when all fit */
+#define RP_SOURCE_HOPS_MASK 0x0F
+#define RP_SOURCE_SHORT_ADDR 0x10
+
+/* A data frame flooded in broadcast, when nobody on the way had a route */
+#define RP_FLOOD_TTL_MASK 0x1F
+
+/* Reports: a topology report, or only the parent (non-storing mode) */
+#define RP_REPORT_PARENT 0x01
+
+/* Route queries go in broadcast, the replies in unicast. A route error
+   (unicast) tells the receiver its route to dest through us loops. */
+#define RP_QUERY_REPLY 0x01
+#define RP_QUERY_ERROR 0x02
+
+/*---------------------------------------------------------------------------*/
+/* Piggyback mode: a report for the parent waits for a data frame going up
+   to it and rides in front of it (RP_MSG_PIGGYBACK), and the beacons carry
+   the parent address instead of ADD_CHILD/REMOVE_CHILD frames. A beacon is
+   not acked: ADD_CHILD/REMOVE_CHILD stay pending until a unicast to that
+   parent is. Whatever is still pending after PIGGYBACK_DEADLINE is sent on
+   its own. The report after a parent change never waits. */
+#ifdef RP_CONF_PIGGYBACK
+#define RP_PIGGYBACK RP_CONF_PIGGYBACK
+#else
+#define RP_PIGGYBACK 1
+#endif
+#define PIGGYBACK_DEADLINE (10 * CLOCK_SECOND)
+#define PIGGYBACK_MAX_LEN 31 // the length has to fit in the header args
+
+struct piggyback_stats {
+  uint16_t carried;    // control messages that rode on an acked frame, or a beacon
+  uint16_t standalone; // sent on their own at the deadline
+};
+
+/*---------------------------------------------------------------------------*/
+/* Non-storing mode: a node reports only its parent, and the report goes up
+   to the sink as it is. The sink keeps the parent of every node
+   (ROUTE_SOURCE routes) and sends what goes down on a source route built
+   from them; the nodes on the way forward on the header only. The others
+   keep no routes down, only their neighbors, the parent and themselves: a
+   relay build needs no more than RP_CONF_MAX_ROUTES = MAX_NEIGHBORS + 2,
+   whatever the size of its subtree. */
+#ifdef RP_CONF_NONSTORING
+#define RP_NONSTORING RP_CONF_NONSTORING
+#else
+#define RP_NONSTORING 0
+#endif
+
+struct nonstoring_stats {
+  uint16_t relayed;  // parent reports passed up
+  uint16_t routed;   // frames the sink sent on a source route
+  uint16_t no_route; // a parent missing on the way, or a loop
+};
+
+/*---------------------------------------------------------------------------*/
+/* Subtree summary: a Bloom filter of the subtree of a node (two bits per
+   node), kept up to date with the subtree. is_in_subtree() looks at it
+   first, so a node not in the subtree costs no scan.
+   Shortcut mode: the beacons of a node with children carry its summary. A
+   frame that would go up to the parent only because we have no route to its
+   destination goes instead to a neighbor not deeper than us that has the
+   destination in its summary: it is shorter than going up to the common
+   ancestor and down again. A false positive of the summary costs a hop, the
+   neighbor sends it up. */
+#ifdef RP_CONF_SHORTCUT
+#define RP_SHORTCUT RP_CONF_SHORTCUT
+#else
+#define RP_SHORTCUT 1
+#endif
+#ifdef RP_CONF_SUBTREE_SUMMARY_BYTES
+#define SUBTREE_SUMMARY_BYTES RP_CONF_SUBTREE_SUMMARY_BYTES
+#else
+#define SUBTREE_SUMMARY_BYTES 16
+#endif
+
 /*---------------------------------------------------------------------------*/
 
 #define REPORT_DELAY_AFTER_PARENT_SWITCH (CLOCK_SECOND * 1) // now i dont use
-#define BEACON_SILENT_LIMIT 20 * CLOCK_SECOND // max time node to be silent after parent switch(update)
+// a node with a stable parent reports again after this (it can be longer
+// with RP_REVERSE_PATH, the data keeps the routes down fresh)
+#ifdef RP_CONF_REPORT_REFRESH_INTERVAL
+#define REPORT_REFRESH_INTERVAL RP_CONF_REPORT_REFRESH_INTERVAL
+#else
+#define REPORT_REFRESH_INTERVAL (20 * CLOCK_SECOND)
+#endif
 /*---------------------------------------------------------------------------*/
 // Cleanup old routes from the routing table
 static const clock_time_t cleanup_interval = CLOCK_SECOND * 120; // bigger than beacon interval
 
 /*---------------------------------------------------------------------------*/
 #define TOPOLOGY_REPORT_INTERVAL (1500 * CLOCK_SECOND) // i dont use 
-#define MAX_SUBTREE_SIZE 10 // Maximum number of nodes in the subtree
 
-#define MAX_BUFFERED_REPORTS 7
+/* Nodes a node keeps in its subtree (and reports to its parent). A subtree
+   can't have more nodes than the routing table, so by default it's the same */
+#ifdef RP_CONF_MAX_SUBTREE_SIZE
+#define MAX_SUBTREE_SIZE RP_CONF_MAX_SUBTREE_SIZE
+#elif RP_NONSTORING
+#define MAX_SUBTREE_SIZE 1 // only ourselves
+#else
+#define MAX_SUBTREE_SIZE MAX_ROUTES
+#endif
+
+/* Subtree entries per report frame. Only the used entries go on air, a
+   bigger subtree is sent in several fragments */
+#ifdef RP_CONF_REPORT_FRAME_ENTRIES
+#define REPORT_FRAME_ENTRIES RP_CONF_REPORT_FRAME_ENTRIES
+#else
+#define REPORT_FRAME_ENTRIES 12
+#endif
 
+/* One topology report frame (RP_MSG_REPORT). A full report of version v goes as
+   fragments 0 .. frags-1, the parent puts it together in order. A delta
+   (frags == 0) has the destinations that joined (subtree[0 .. added-1]) or
+   left (the rest) the subtree since the report base_version. */
 struct topology_report {
+  uint8_t type;
   linkaddr_t node;
   uint16_t metric;
-  uint16_t subtree_size;
-  linkaddr_t subtree[MAX_SUBTREE_SIZE];
-  //uint16_t seqn;
+  uint8_t version;      // report version, the base of the next delta
+  uint8_t base_version; // delta: the version it goes on top of
+  uint8_t frag;         // full: index of this fragment
+  uint8_t frags;        // full: fragments of this version, 0 for a delta
+  uint8_t added;        // delta: entries that joined, the others left
+  linkaddr_t subtree[REPORT_FRAME_ENTRIES];
 
 } __attribute__((packed));
 
-struct pending_topology_reports {
-  struct topology_report reports[MAX_BUFFERED_REPORTS];
-  int count;
+/* Parent report (non-storing mode) */
+struct parent_report {
+  uint8_t type; // RP_MSG_HDR(RP_MSG_REPORT, RP_REPORT_PARENT)
+  linkaddr_t node;
+  linkaddr_t parent;
+  uint16_t metric; // of the node
+} __attribute__((packed));
+
+/*---------------------------------------------------------------------------*/
+/* Delta topology reports: a node sends only the destinations added to or
+   removed from its subtree since its previous report. The parent applies a
+   delta only on top of the version it is based on, otherwise it asks the
+   child for a full report (REPORT_RESYNC). A full report also goes out
+   every TOPOLOGY_FULL_REPORT_EVERY reports, after a parent change and when
+   the changes do not fit in one frame. */
+#ifdef RP_CONF_TOPOLOGY_DELTA_REPORTS
+#define TOPOLOGY_DELTA_REPORTS RP_CONF_TOPOLOGY_DELTA_REPORTS
+#else
+#define TOPOLOGY_DELTA_REPORTS 1 // 0: always send full reports
+#endif
+#define TOPOLOGY_FULL_REPORT_EVERY 8
+#define MAX_REPORT_CHILDREN 8 // children whose report version is tracked
+
+/* Report state per child */
+struct report_sync {
+  linkaddr_t child;
+  uint8_t version;    // last complete report applied
+  bool synced;        // false until the first full report is complete
+  uint8_t rx_version; // full report being put together
+  uint8_t rx_next;    // its next fragment, REPORT_RX_LOST after a gap
+};
+#define REPORT_RX_LOST 0xFF
+
+struct report_stats {
+  uint16_t full_sent;
+  uint16_t delta_sent;
+  uint16_t frames_sent;
+  uint16_t resync_requests; // reports refused because something was missing
+  uint16_t frames_recv;     // report frames of the children applied
+  uint16_t coalesced;       // triggers that went up in a report already due
+  /* full reports of the children applied to the table */
+  uint16_t routes_added;     // new, or through the child now
+  uint16_t routes_removed;   // through the child, not in its report any more
+  uint16_t routes_refreshed; // already there, updated in place
 };
 
+/* Report scheduler: a change of the subtree only marks our report dirty. It
+   goes up when the token bucket has a token (one every REPORT_MIN_INTERVAL,
+   REPORT_BURST at most), otherwise when the next token comes plus some
+   jitter. Only a parent change sends at once. */
+#ifdef RP_CONF_REPORT_MIN_INTERVAL
+#define REPORT_MIN_INTERVAL RP_CONF_REPORT_MIN_INTERVAL
+#else
+#define REPORT_MIN_INTERVAL (10 * CLOCK_SECOND)
+#endif
+#define REPORT_BURST 2
+
+/* Our own report goes up after those of the children: once no child frame
+   came for twice the usual gap between them (within REPORT_BATCH_MIN ..
+   REPORT_BATCH_MAX), and at most REPORT_BATCH_MAX after the first one. A
+   burst of churn below us goes up in one report, a lone report goes up
+   sooner when the children report quickly after each other. */
+#define REPORT_BATCH_MIN (CLOCK_SECOND / 2)
+#define REPORT_BATCH_MAX (6 * CLOCK_SECOND)
+
 /*---------------------------------------------------------------------------*/
-#define RSSI_THRESHOLD -95
+#define RSSI_THRESHOLD -95 // on the smoothed RSSI of the neighbor
+
 #define MAX_PATH_LENGTH 10  // Maximum number of hops
+#if MAX_PATH_LENGTH > RP_DATA_HOPS_MASK || MAX_PATH_LENGTH >= RP_DATA_RANK_INFINITE
+#error "MAX_PATH_LENGTH does not fit in the data header"
+#endif
+
+/* Neighbor table: link estimates of the nodes we hear beacons from. RSSI and
+   LQI are smoothed over the beacons, the ETX over the unicast tx outcomes
+   (acked after num_tx transmissions, or NEIGHBOR_ETX_NOACK). ETX values are
+   fixed point, ETX_SCALE is one transmission. */
+#ifdef RP_CONF_MAX_NEIGHBORS
+#define MAX_NEIGHBORS RP_CONF_MAX_NEIGHBORS
+#else
+#define MAX_NEIGHBORS 16
+#endif
+#define ETX_SCALE 16
+#define ETX_INFINITE 0xFFFF
+#define NEIGHBOR_ETX_INIT (2 * ETX_SCALE)   // before the first unicast to it
+#define NEIGHBOR_ETX_NOACK (8 * ETX_SCALE)  // a frame never acked
+#define NEIGHBOR_ETX_ALPHA 2  // weight of a new tx sample, out of 16
+#define NEIGHBOR_RSSI_ALPHA 4 // same for the RSSI and LQI of a beacon
+
+/* Parent selection on the path ETX (the parent's advertised one plus our
+   link to it): a neighbor becomes the parent only if it is better by more
+   than PARENT_SWITCH_THRESHOLD, and we advertise a new path ETX only when
+   it moved by PATH_ETX_CHANGE or more */
+#define PARENT_SWITCH_THRESHOLD (ETX_SCALE * 3 / 2)
+#define PATH_ETX_CHANGE (2 * ETX_SCALE)
+
+/* Parent failover: after this many unicasts in a row not acked by the
+   parent, switch at once to the best other neighbor closer to the sink,
+   or stay without a parent until the next beacon */
+#ifdef RP_CONF_PARENT_FAIL_THRESHOLD
+#define PARENT_FAIL_THRESHOLD RP_CONF_PARENT_FAIL_THRESHOLD
+#else
+#define PARENT_FAIL_THRESHOLD 3
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* Forwarding queue: the data frames, ours and forwarded, go to the MAC one at
+   a time. The next one goes when the sent callback of the previous comes;
+   they wait in queuebufs from the shared pool meanwhile. A frame the MAC
+   could not send (busy, queue full) is tried again after FORWARD_RETRY_DELAY,
+   a frame never acked is dropped (the MAC retried it already). */
+#ifdef RP_CONF_FORWARD_QUEUE_LEN
+#define FORWARD_QUEUE_LEN RP_CONF_FORWARD_QUEUE_LEN
+#else
+#define FORWARD_QUEUE_LEN 4
+#endif
+#define FORWARD_MAX_RETRIES 3
+#define FORWARD_RETRY_DELAY (CLOCK_SECOND / 16)
+/* Longest wait for the sent callback of the frame in the MAC: after it the
+   frame counts as not sent, the queue does not stay stuck on it */
+#define FORWARD_SENT_TIMEOUT (8 * CLOCK_SECOND)
+
+struct forward_entry {
+  struct queuebuf *qb;
+  linkaddr_t next_hop;
+  uint8_t retries;
+  bool down; // stamped RP_DATA_DOWN when it last went to the MAC
+};
+
+struct forward_stats {
+  uint16_t sent;
+  uint16_t tx_failed;  // not acked, or not sent after FORWARD_MAX_RETRIES
+  uint16_t drops;      // queue or queuebuf pool full
+  uint16_t shortcuts;  // frames sent sideways instead of up to the parent
+  uint8_t high_water;  // max frames queued at the same time
+};
+
+/* Congestion: a node with CONGESTION_QUEUE frames or more in its forwarding
+   queue, or with more than CONGESTION_FAIL_RATE (out of 256, smoothed) of
+   its frames not sent, is congested until the queue is down to one frame
+   and the rate to half of it. It says so in its beacons and in the data
+   frames it sends. A congested neighbor costs CONGESTION_ETX_PENALTY more as
+   a parent, and rp_send() returns RP_SEND_CONGESTED when we or the next hop
+   are congested: the frame went, but the source should slow down. */
+#ifdef RP_CONF_CONGESTION
+#define RP_CONGESTION RP_CONF_CONGESTION
+#else
+#define RP_CONGESTION 1
+#endif
+#ifdef RP_CONF_CONGESTION_QUEUE
+#define CONGESTION_QUEUE RP_CONF_CONGESTION_QUEUE
+#else
+#define CONGESTION_QUEUE (FORWARD_QUEUE_LEN * 3 / 4)
+#endif
+#define CONGESTION_FAIL_RATE 96
+#define CONGESTION_FAIL_ALPHA 2
+#define CONGESTION_ETX_PENALTY (3 * ETX_SCALE)
+
+struct congestion_stats {
+  uint16_t onsets;      // times we became congested
+  uint16_t heard;       // neighbors seen becoming congested
+  uint16_t avoided;     // parent switches away from a congested parent
+  uint16_t send_hints;  // RP_SEND_CONGESTED returned to the application
+};
+
+/* Local repair: a frame going down that the next hop did not ack goes
+   straight to the destination if it is a neighbor, otherwise it waits up to
+   ROUTE_REPAIR_TIMEOUT for a neighbor to answer a one-hop route query. The
+   first answer patches the route in place. One repair at a time. */
+#define ROUTE_REPAIR_TIMEOUT (CLOCK_SECOND / 4)
+
+struct repair_stats {
+  uint16_t direct;   // sent straight to the destination
+  uint16_t queried;
+  uint16_t repaired; // a neighbor answered the query
+  uint16_t failed;   // nobody answered, or a repair was in progress
+};
+
+/* Loops in the datapath: a frame that goes up to a node not closer to the
+   sink, or down to a node above the sender, breaks the rank order. The
+   first break may be stale ranks and is let through, the second one drops
+   the frame. So does a frame whose next hop is the node it came from. The
+   node that sent it the wrong way gets a route error, or our beacons if it
+   has an old rank of ours. */
+struct loop_stats {
+  uint16_t rank_errors;  // frames that came against the rank order
+  uint16_t drops;        // dropped for a loop
+  uint16_t bounces;      // next hop was where the frame came from
+  uint16_t route_errors; // sent
+};
+
+/* Flooding fallback: a data frame with no route at all (at the sink, or at
+   a node without a parent) goes in broadcast for up to FLOOD_TTL hops. A
+   node takes each frame once (the duplicate cache): the destination
+   delivers it, a node with a route to it sends it on in unicast, the others
+   broadcast it again, after a random wait up to FLOOD_JITTER, and not at
+   all if FLOOD_SUPPRESS neighbors did it first. How often it starts tells
+   whether the reports keep up with the topology. */
+#ifdef RP_CONF_FLOOD
+#define RP_FLOOD RP_CONF_FLOOD
+#else
+#define RP_FLOOD 1
+#endif
+#ifdef RP_CONF_FLOOD_TTL
+#define FLOOD_TTL RP_CONF_FLOOD_TTL
+#else
+#define FLOOD_TTL 4
+#endif
+#ifdef RP_CONF_FLOOD_JITTER
+#define FLOOD_JITTER RP_CONF_FLOOD_JITTER
+#else
+#define FLOOD_JITTER (CLOCK_SECOND / 4)
+#endif
+#define FLOOD_SUPPRESS 2
+#if FLOOD_TTL > RP_FLOOD_TTL_MASK
+#error "FLOOD_TTL does not fit in the header"
+#endif
+
+struct flood_stats {
+  uint16_t started;    // frames we had no route for
+  uint16_t forwarded;  // broadcast again
+  uint16_t converted;  // sent on in unicast, we had a route
+  uint16_t suppressed; // copies seen already
+  uint16_t cancelled;  // the neighbors broadcast it first
+};
+
+/* Duplicate cache: the (source, seqn) of the last DUP_CACHE_SIZE data
+   packets received, a copy of one of them is not forwarded or delivered */
+#ifdef RP_CONF_DUP_CACHE_SIZE
+#define DUP_CACHE_SIZE RP_CONF_DUP_CACHE_SIZE
+#else
+#define DUP_CACHE_SIZE 8
+#endif
+
+struct dup_entry {
+  linkaddr_t source;
+  uint8_t seqn;
+};
+
+struct dup_stats {
+  uint16_t hits;   // duplicates dropped
+  uint16_t misses;
+};
+
+/* Reverse-path learning: a data frame coming up from a child is a route to
+   its source through that child. It is soft state (ROUTE_REVERSE, purged
+   like the others when no traffic refreshes it), at REVERSE_ROUTE_PRIORITY
+   among the levels of route_priority(): by default that of the topology
+   routes, so the fresher of the two wins. Not in non-storing mode, the
+   sink routes on the parents there. */
+#ifdef RP_CONF_REVERSE_PATH
+#define RP_REVERSE_PATH RP_CONF_REVERSE_PATH
+#else
+#define RP_REVERSE_PATH 1
+#endif
+#ifdef RP_CONF_REVERSE_ROUTE_PRIORITY
+#define REVERSE_ROUTE_PRIORITY RP_CONF_REVERSE_ROUTE_PRIORITY
+#else
+#define REVERSE_ROUTE_PRIORITY 2
+#endif
+
+struct reverse_stats {
+  uint16_t learned;   // new routes, or through another next hop now
+  uint16_t refreshed; // the route went through the child already
+};
+
 /*---------------------------------------------------------------------------*/
 /* for beacon */
 #define MIN_PARENT_SWITCH_INTERVAL (40 * CLOCK_SECOND) // min 40 sec for one parent
 
-#define BEACON_FORWARD_DELAY ((random_rand() % CLOCK_SECOND)) // random delay to avoid collisions when forwarding beacons
-#define BEACON_INITIAL_INTERVAL (15 * CLOCK_SECOND) 
-#define BEACON_MIN_INTERVAL     (10 * CLOCK_SECOND) 
-#define BEACON_MAX_INTERVAL     (70 * CLOCK_SECOND)
-#define STABILITY_THRESHOLD     3   // number of beacons to consider parent stable
-extern clock_time_t current_beacon_interval;
+/* Beacons are paced by a Trickle timer (RFC 6206): a node sends its beacon
+   at a random time in the second half of each interval, unless it already
+   heard BEACON_TRICKLE_K consistent beacons in it. The interval doubles from
+   BEACON_IMIN up to BEACON_IMAX, and goes back to BEACON_IMIN on an
+   inconsistency: a newer seqn, a change of our path ETX or of our parent,
+   or a neighbor that lost its parent (it advertises ETX_INFINITE). */
+#define BEACON_INITIAL_INTERVAL (15 * CLOCK_SECOND) // the sink starts after it
+#define BEACON_IMIN (1 * CLOCK_SECOND)
+#define BEACON_IMAX (64 * CLOCK_SECOND)
+#define BEACON_TRICKLE_K 2
+
+/* Global repair: the sink starts a new seqn this often. Every node takes it
+   from its parent and resets its Trickle timer, so the whole tree advertises
+   again and a node left without a parent finds one. 0 turns it off. */
+#ifdef RP_CONF_GLOBAL_REPAIR_INTERVAL
+#define GLOBAL_REPAIR_INTERVAL RP_CONF_GLOBAL_REPAIR_INTERVAL
+#else
+#define GLOBAL_REPAIR_INTERVAL (10 * 60 * CLOCK_SECOND)
+#endif
+// a is a newer seqn than b, also across the wrap
+#define BEACON_SEQN_NEWER(a, b) ((int16_t)((uint16_t)(a) - (uint16_t)(b)) > 0)
+
+struct beacon_stats {
+  uint16_t sent;
+  uint16_t suppressed; // k consistent beacons heard in the interval
+  uint16_t resets;     // inconsistencies that shortened the interval
+};
 
 /*---------------------------------------------------------------------------*/
 /* types of routes */
@@ -61,24 +492,130 @@ typedef enum {
   ROUTE_TOPOLOGY = 0,
   ROUTE_PARENT = 1,
   ROUTE_NEIGHBOR = 2,
-  ROUTE_SELF = 3
+  ROUTE_SELF = 3,
+  ROUTE_SOURCE = 4, // sink, non-storing: next_hop is the parent of destination
+  ROUTE_REVERSE = 5 // learned from the data frames of destination
 } route_type_t; // just to distinguish routes -- different from priority
 
 /*---------------------------------------------------------------------------*/
 /* Routing table */
+/* All entries come from a fixed static pool (no malloc), so the RAM used by
+   the table is fixed at compile time. The sink keeps a route to every node:
+   10 in cooja, 36 on the testbed. */
+#ifdef RP_CONF_MAX_ROUTES
+#define MAX_ROUTES RP_CONF_MAX_ROUTES
+#else
+#define MAX_ROUTES 40
+#endif
+
+/* The summary a node keeps of its own subtree has about a byte per node, so
+   that it doesn't fill up; the beacons carry it folded (ORed) down to
+   SUBTREE_SUMMARY_BYTES. A power of two times that, 4096 bits at most
+   (here, as MAX_SUBTREE_SIZE needs MAX_ROUTES). Each bit has a 4-bit count
+   behind it, so a node leaves the summary without a rebuild. */
+#if MAX_SUBTREE_SIZE <= SUBTREE_SUMMARY_BYTES
+#define SUBTREE_FILTER_BYTES SUBTREE_SUMMARY_BYTES
+#elif MAX_SUBTREE_SIZE <= 2 * SUBTREE_SUMMARY_BYTES
+#define SUBTREE_FILTER_BYTES (2 * SUBTREE_SUMMARY_BYTES)
+#elif MAX_SUBTREE_SIZE <= 4 * SUBTREE_SUMMARY_BYTES
+#define SUBTREE_FILTER_BYTES (4 * SUBTREE_SUMMARY_BYTES)
+#elif MAX_SUBTREE_SIZE <= 8 * SUBTREE_SUMMARY_BYTES || SUBTREE_SUMMARY_BYTES >= 64
+#define SUBTREE_FILTER_BYTES (8 * SUBTREE_SUMMARY_BYTES)
+#elif MAX_SUBTREE_SIZE <= 16 * SUBTREE_SUMMARY_BYTES || SUBTREE_SUMMARY_BYTES >= 32
+#define SUBTREE_FILTER_BYTES (16 * SUBTREE_SUMMARY_BYTES)
+#else
+#define SUBTREE_FILTER_BYTES 512
+#endif
+#if SUBTREE_FILTER_BYTES > 512
+#error "RP_CONF_SUBTREE_SUMMARY_BYTES too big for the subtree"
+#endif
+
+/* Compact timestamp of the routes: seconds, wraps after ~18 hours
+   (compare only with differences, see route_age()). From clock_seconds():
+   clock_time() / CLOCK_SECOND wraps with a 16-bit clock_time_t (every 512 s
+   on sky), not at 65536 s. */
+typedef uint16_t route_time_t;
+#define ROUTE_TIME_NOW() ((route_time_t)clock_seconds())
+
+/* Fields ordered so that the entry is 10 bytes without padding (and without
+   packed, so no unaligned word access on the msp430) */
 typedef struct {
   linkaddr_t destination;
   linkaddr_t next_hop;
-  route_type_t type;
+  uint8_t type;               // route_type_t, kept in one byte
+  int8_t rssi;                // dBm, fits in one byte
   uint16_t metric;
-  int16_t rssi;
-  clock_time_t last_updated;
+  route_time_t last_updated;
 } routing_entry_t;
 
-typedef struct routing_entry_node {
-  routing_entry_t entry;
-  struct routing_entry_node *next;
-} routing_entry_node_t;
+/* Buckets of the destination index (2^bits), must be more than MAX_ROUTES.
+   By default the index is kept at most ~60% full. */
+#ifdef RP_CONF_ROUTE_BUCKET_BITS
+#define ROUTE_BUCKET_BITS RP_CONF_ROUTE_BUCKET_BITS
+#elif MAX_ROUTES <= 40
+#define ROUTE_BUCKET_BITS 6
+#elif MAX_ROUTES <= 80
+#define ROUTE_BUCKET_BITS 7
+#elif MAX_ROUTES <= 160
+#define ROUTE_BUCKET_BITS 8
+#elif MAX_ROUTES <= 320
+#define ROUTE_BUCKET_BITS 9
+#elif MAX_ROUTES <= 640
+#define ROUTE_BUCKET_BITS 10
+#elif MAX_ROUTES <= 1280
+#define ROUTE_BUCKET_BITS 11
+#elif MAX_ROUTES <= 2560
+#define ROUTE_BUCKET_BITS 12
+#elif MAX_ROUTES <= 5120
+#define ROUTE_BUCKET_BITS 13
+#else
+#define ROUTE_BUCKET_BITS 14
+#endif
+
+/* Direct-mapped index at the sink, that has a route to every node: the
+   home bucket of a destination is its node id, so ids below ROUTE_BUCKETS
+   never collide and a lookup or a report entry touches one bucket. The
+   other nodes keep the hash. The id is ROUTE_NODE_ID(addr): by default the
+   address itself, that is the id in the low byte in cooja. The testbed
+   addresses are not small ids: there it is off unless the build maps them
+   (RP_CONF_NODE_ID, with its deployment table). Other addresses still
+   probe, as with the hash. */
+#ifdef RP_CONF_ROUTE_DIRECT
+#define ROUTE_DIRECT RP_CONF_ROUTE_DIRECT
+#elif CONTIKI_TARGET_ZOUL && !defined(RP_CONF_NODE_ID)
+#define ROUTE_DIRECT 0
+#else
+#define ROUTE_DIRECT 1
+#endif
+#ifdef RP_CONF_NODE_ID
+#define ROUTE_NODE_ID(addr) RP_CONF_NODE_ID(addr)
+#else
+#define ROUTE_NODE_ID(addr) ((addr)->u8[0] | ((uint16_t)(addr)->u8[1] << 8))
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* Neighbor table entry */
+typedef struct {
+  linkaddr_t addr;
+  int16_t rssi;        // dBm, smoothed
+  uint8_t lqi;         // smoothed
+  uint8_t tx_samples;  // unicast outcomes in the ETX, saturates
+  uint8_t tx_fails;    // unicasts not acked in a row
+  uint16_t etx;        // link ETX
+  uint16_t path_etx;   // what it advertises, ETX_INFINITE if nothing
+  route_time_t last_seen;
+  uint8_t metric;      // its hops to the sink, saturates
+  bool congested;      // as its last beacon or data frame said
+  uint8_t summary[SUBTREE_SUMMARY_BYTES]; // its subtree, all zero for a leaf
+} neighbor_entry_t;
+
+struct neighbor_stats {
+  uint16_t tx_ok;
+  uint16_t tx_noack;
+  uint16_t tx_collisions;
+  uint16_t evictions; // neighbors dropped from a full table
+  uint16_t failovers; // parents given up after PARENT_FAIL_THRESHOLD
+};
 
 /*---------------------------------------------------------------------------*/
 /* Callback structure */
@@ -93,25 +630,99 @@ struct rp_conn {
   const struct rp_callbacks* callbacks;
 
   linkaddr_t parent;
-  uint8_t parent_stable_counter;
   clock_time_t last_parent_change;
+  clock_time_t last_report_refresh;
 
+  /* beacon Trickle timer */
   struct ctimer beacon_timer;
-  clock_time_t current_beacon_interval;
-  clock_time_t last_beacon_forward;
-
-  uint16_t metric;
+  clock_time_t trickle_i; // current interval, 0 until we have something to send
+  clock_time_t trickle_t; // when in the interval we send
+  uint8_t trickle_c;      // consistent beacons heard in the interval
+  struct beacon_stats beacon_stats;
+  struct ctimer global_repair_timer; // sink only
+
+  uint16_t metric;   // hops to the sink
+  uint16_t path_etx; // what we advertise, ETX_INFINITE without a parent
   uint16_t beacon_seqn;
   int16_t rssi;
   bool is_sink;
-  uint8_t subtree_size;
+  struct neighbor_stats nbr_stats;
+  uint16_t subtree_size; // MAX_SUBTREE_SIZE can be more than 255 on the host
   linkaddr_t subtree[MAX_SUBTREE_SIZE];
+  uint8_t subtree_summary[SUBTREE_FILTER_BYTES];
+  uint8_t subtree_counts[SUBTREE_FILTER_BYTES * 4]; // a 4-bit count per summary bit
   struct ctimer cleanup_timer;
   struct ctimer report_timer;
 
-  struct pending_topology_reports pending_reports;
   struct ctimer report_delay_timer;
   int report_timer_active;
+  clock_time_t report_batch_start; // first child frame of the batch
+  clock_time_t report_last_rx;
+  clock_time_t report_gap; // smoothed gap between the child frames of a batch
+  bool report_dirty;        // waits for a token
+  uint8_t report_tokens;
+  clock_time_t report_token_time; // the last token came then
+  struct ctimer report_sched_timer;
+
+  /* delta reports: what the parent has from us */
+  linkaddr_t reported[MAX_SUBTREE_SIZE];
+  uint16_t reported_size; // as subtree_size, MAX_SUBTREE_SIZE may pass 255
+  linkaddr_t reported_parent;
+  uint8_t report_version;
+  uint8_t reports_since_full;
+  bool report_force_full;
+  /* and what we have from the children */
+  struct report_sync report_sync[MAX_REPORT_CHILDREN];
+  uint8_t report_sync_next;
+  struct report_stats report_stats;
+
+  /* data frames waiting for the MAC, fwd_queue[fwd_head] is in flight */
+  struct forward_entry fwd_queue[FORWARD_QUEUE_LEN];
+  uint8_t fwd_head;
+  uint8_t fwd_len;
+  bool fwd_busy;
+  linkaddr_t fwd_to;  // receiver of the head while it is in the MAC, else null
+  packetbuf_attr_t fwd_seqno; // its MAC seqno, once unicast_send() returned
+  bool fwd_seqno_known;
+  struct ctimer fwd_retry_timer;
+  struct ctimer fwd_sent_timer;
+  struct forward_stats fwd_stats;
+
+  /* congestion: ours, and the smoothed rate of frames not sent */
+  bool congested;
+  uint16_t tx_fail_rate;
+  struct congestion_stats cong_stats;
+
+  /* data seqn of our packets, and the packets seen lately */
+  uint8_t data_seqn;
+  struct dup_entry dup_cache[DUP_CACHE_SIZE];
+  uint8_t dup_cache_len;
+  uint8_t dup_cache_next;
+  struct dup_stats dup_stats;
+  struct reverse_stats rev_stats;
+  struct flood_stats flood_stats;
+  struct loop_stats loop_stats;
+  struct nonstoring_stats ns_stats;
+
+  /* local repair: the frame waiting for a query answer */
+  struct queuebuf *repair_qb;
+  linkaddr_t repair_dest;
+  linkaddr_t repair_avoid; // the next hop that did not ack
+  struct ctimer repair_timer;
+  struct repair_stats repair_stats;
+
+  /* flooding: the frame waiting to be broadcast again */
+  struct queuebuf *flood_qb;
+  linkaddr_t flood_source;
+  uint8_t flood_seqn;
+  uint8_t flood_heard; // copies heard from the neighbors meanwhile
+  struct ctimer flood_timer;
+
+  /* piggyback: control messages waiting for a frame to ride on */
+  uint8_t pb_pending;
+  linkaddr_t pb_old_parent; // where the pending REMOVE_CHILD goes
+  struct ctimer pb_timer;   // the deadline
+  struct piggyback_stats pb_stats;
 
   /*---------------------------------------------------------------------------*/
   /*
@@ -139,18 +750,38 @@ void rp_open(
     bool is_sink, 
     const struct rp_callbacks *callbacks);
 
+/* > 0 if the frame went (RP_SEND_CONGESTED: slow down), 0 if it was
+   dropped, < 0 on errors */
+#define RP_SEND_CONGESTED 2
 int rp_send(struct rp_conn *c, const linkaddr_t *dest);
 
 void bc_recv(struct broadcast_conn *conn, const linkaddr_t *sender);
 void uc_recv(struct unicast_conn *c, const linkaddr_t *from);
 
-void beacon_timer_cb(void* ptr);
+void beacon_trickle_reset(struct rp_conn *conn);
 void cleanup_timer_callback(void *ptr);
 
+/*---------------------------------------------------------------------------*/
+/* Routing table pool usage */
+struct route_pool_stats {
+  uint16_t used;
+  uint16_t high_water;  // max entries in use at the same time
+  uint16_t alloc_fails; // routes not added because the pool was full
+  uint32_t allocs;      // slots taken since rp_open()
+};
+void route_pool_get_stats(struct route_pool_stats *stats);
+void print_route_pool_stats(void);
+
 /*---------------------------------------------------------------------------*/
 /* Functions to delete routes */
+void purge_old_routes(struct rp_conn *conn);
 void delete_route_by_next_hop(struct rp_conn *conn, const linkaddr_t *next_hop, bool is_sink);
 void delete_route(const linkaddr_t *destination, const linkaddr_t *next_hop) ;
+void refresh_routes_by_next_hop(const linkaddr_t *next_hop);
+
+// to point an existing route elsewhere (local repair)
+void patch_route(struct rp_conn *conn, const linkaddr_t *destination, const linkaddr_t *next_hop,
+                 uint16_t metric, int16_t rssi);
 
 /* Return priority of route types */
 int route_priority(route_type_t t);
@@ -170,6 +801,11 @@ void add_new_route(struct rp_conn *conn, const linkaddr_t *destination, const li
 void send_topology_report( void *ptr, char* lol); 
 
 // to update the routing table based on a received topology report
-void update_routing_table(struct rp_conn *conn, const struct topology_report *report);
+void update_routing_table(struct rp_conn *conn, const struct topology_report *report, uint8_t entries);
+
+// to keep the list of nodes reported to the parent
+void add_to_subtree(struct rp_conn *conn, const linkaddr_t *child);
+void remove_from_subtree(struct rp_conn *conn, const linkaddr_t *child);
+bool is_in_subtree(struct rp_conn *conn, const linkaddr_t *node);
 
 #endif // RP_HPP